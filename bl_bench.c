@@ -0,0 +1,221 @@
+// Measure what compressing message bodies costs and saves: encodes
+// and decodes sample messages with ENC_COMPACT and ENC_LZ and reports
+// bytes per message and time per message. A file named on the command
+// line is used as an extra sample, cut into MAXLINE-1 byte bodies.
+// Then times masking banned phrases in a chat line with the rules
+// automaton against a strstr() per rule, for growing numbers of rules,
+// then the scalar and SSE2 scans for printable ASCII that let plain
+// chat through untouched and the cost of cleaning control bytes and
+// bad UTF-8 out of various bodies.
+
+# include "blather.h"
+# include <time.h>
+
+#define BENCH_ROUNDS 20000      // encodes and decodes timed per sample
+#define RULES_ROUNDS 20000      // chat lines masked per rule set
+#define CLEAN_ROUNDS 200000     // bodies scanned per sample
+
+// sample: one kind of body people send
+typedef struct {
+  char *label;                  // what the body is like
+  char body[MAXLINE];           // the body itself
+} sample_t;
+
+static long now_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Fill body with up to MAXLINE-1 bytes of text made by repeating
+// lines from a pasted log with changing numbers in them.
+static void make_log_paste(char *body) {
+    int len = 0;
+    for (int i = 0; len < MAXLINE - 100; ++i) {
+        len += sprintf(body + len, "2024-03-0%d 12:%02d:%02d WARN worker-%d: retrying request %d after timeout\n",
+                       1 + i % 9, i % 60, (i * 7) % 60, i % 4, 1000 + i * 13);
+    }
+}
+
+// Fill body with a stack trace like those pasted when asking for help.
+static void make_stack_trace(char *body) {
+    int len = sprintf(body, "Segmentation fault (core dumped)\n");
+    char *fns[] = {"server_handle_client", "server_broadcast", "server_enqueue",
+                   "server_flush_client", "main"};
+    for (int i = 0; len < MAXLINE - 100; ++i) {
+        len += sprintf(body + len, "#%d  0x%012lx in %s (server=0x%lx, idx=%d) at server_funcs.c:%d\n",
+                       i, 0x55555555a000L + i * 0x1c3, fns[i % 5], 0x7fffffffd000L, i % 3, 100 + i * 37);
+    }
+}
+
+// Fill body with len bytes that do not compress.
+static void make_random(char *body, int len) {
+    srand(1);
+    for (int i = 0; i < len; ++i) {
+        body[i] = 'A' + rand() % 58;
+    }
+    body[len] = '\0';
+}
+
+// Encode and decode mesg BENCH_ROUNDS times with enc and print the
+// results in a row of the table.
+static void bench_one(char *label, mesg_t *mesg, int enc) {
+    char buf[FRAME_MAX];
+    mesg_t out;
+    int len = 0;
+    long start = now_nanos();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        len = mesg_encode_for(mesg, enc, 0, buf);
+    }
+    long enc_nanos = (now_nanos() - start) / BENCH_ROUNDS;
+    start = now_nanos();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        mesg_decode(buf, len, &out, NULL);
+    }
+    long dec_nanos = (now_nanos() - start) / BENCH_ROUNDS;
+    check_fail(strcmp(out.body, mesg->body) != 0, 0, "%s: body changed in round trip\n", label);
+    printf("%-14s %-8s %6zu %6d %7.1f%% %8ld %8ld\n", label, enc == ENC_LZ ? "lz" : "compact",
+           strlen(mesg->body), len, 100.0 * len / (sizeof(wire_hdr_t) + strlen(mesg->body)),
+           enc_nanos, dec_nanos);
+}
+
+// Time masking a chat line against n_rules made up phrases, once with
+// the automaton and once with strstr() per phrase, and print the
+// results in a row of the table.
+static void bench_rules(int n_rules) {
+    char **rules = malloc(sizeof(char *) * n_rules);
+    srand(n_rules);
+    for (int r = 0; r < n_rules; ++r) {
+        int len = 4 + rand() % 9;
+        rules[r] = malloc(len + 1);
+        for (int i = 0; i < len; ++i) {
+            rules[r][i] = 'a' + rand() % 26;
+        }
+        rules[r][len] = '\0';
+    }
+    char *line = "has anyone seen the build failing on the lab machines after the compiler update, "
+                 "the linker says undefined reference to server_flush_client and I cannot tell why";
+    char text[MAXLINE];
+
+    long start = now_nanos();
+    matcher_t *m = matcher_build(rules, n_rules);
+    long build_nanos = now_nanos() - start;
+    start = now_nanos();
+    for (int i = 0; i < RULES_ROUNDS; ++i) {
+        strcpy(text, line);
+        matcher_mask(m, text);
+    }
+    long ac_nanos = (now_nanos() - start) / RULES_ROUNDS;
+
+    int rounds = RULES_ROUNDS / n_rules + 1; // strstr() gets slow
+    start = now_nanos();
+    for (int i = 0; i < rounds; ++i) {
+        strcpy(text, line);
+        for (int r = 0; r < n_rules; ++r) {
+            for (char *hit = strstr(text, rules[r]); hit != NULL; hit = strstr(hit + 1, rules[r])) {
+                memset(hit, '*', strlen(rules[r]));
+            }
+        }
+    }
+    long naive_nanos = (now_nanos() - start) / rounds;
+
+    printf("%-8d %8d %10.2f %8ld %10ld %12ld\n", n_rules, m->n_states, build_nanos / 1e6,
+           ac_nanos, naive_nanos, 1000000000L / ac_nanos);
+    matcher_free(m);
+    for (int r = 0; r < n_rules; ++r) {
+        free(rules[r]);
+    }
+    free(rules);
+}
+
+// Time cleaning a copy of body with text_sanitize() and print the
+// results in a row of the table.
+static void bench_clean(char *label, char *body) {
+    char text[MAXLINE];
+    int fixed = 0;
+    long start = now_nanos();
+    for (int i = 0; i < CLEAN_ROUNDS; ++i) {
+        strcpy(text, body);
+        fixed = text_sanitize(text, MAXLINE, 0);
+    }
+    long clean_nanos = (now_nanos() - start) / CLEAN_ROUNDS;
+    printf("%-14s %6zu %6d %10ld\n", label, strlen(body), fixed, clean_nanos);
+}
+
+// Time the scalar and SSE2 scans over MAXLINE-1 printable bytes, the
+// path all plain chat takes, and print the results.
+static void bench_scan() {
+    char text[MAXLINE];
+    memset(text, 'x', MAXLINE - 1);
+    text[MAXLINE - 1] = '\0';
+    int len = MAXLINE - 1;
+    long total = 0;
+    long start = now_nanos();
+    for (int i = 0; i < CLEAN_ROUNDS; ++i) {
+        total += text_ascii_prefix_scalar(text, len);
+    }
+    long scalar_nanos = (now_nanos() - start) / CLEAN_ROUNDS;
+    start = now_nanos();
+    for (int i = 0; i < CLEAN_ROUNDS; ++i) {
+        total += text_ascii_prefix(text, len);
+    }
+    long simd_nanos = (now_nanos() - start) / CLEAN_ROUNDS;
+    check_fail(total != 2L * CLEAN_ROUNDS * len, 0, "scans disagree\n");
+    printf("\n%-14s %10s %10s %10s %10s\n", "printable scan", "scalar ns", "sse2 ns", "scalar MB/s", "sse2 MB/s");
+    printf("%-14d %10ld %10ld %10.0f %10.0f\n", len, scalar_nanos, simd_nanos,
+           len * 1000.0 / scalar_nanos, len * 1000.0 / simd_nanos);
+}
+
+int main(int argc, char *argv[]) {
+    static sample_t samples[5];
+    int n_samples = 0;
+    samples[n_samples].label = "chat line";
+    strcpy(samples[n_samples++].body, "anyone know why the build fails on the lab machines today?");
+    samples[n_samples].label = "log paste";
+    make_log_paste(samples[n_samples++].body);
+    samples[n_samples].label = "stack trace";
+    make_stack_trace(samples[n_samples++].body);
+    samples[n_samples].label = "random";
+    make_random(samples[n_samples++].body, MAXLINE - 1);
+    if (argc > 1) {
+        FILE *file = fopen(argv[1], "r");
+        check_fail(file == NULL, 1, "open %s error.\n", argv[1]);
+        samples[n_samples].label = "file";
+        fread(samples[n_samples].body, 1, MAXLINE - 1, file);
+        n_samples++;
+        fclose(file);
+    }
+
+    printf("%-14s %-8s %6s %6s %8s %8s %8s\n", "sample", "encoding", "body", "frame", "ratio", "enc ns", "dec ns");
+    for (int s = 0; s < n_samples; ++s) {
+        mesg_t mesg;
+        memset(&mesg, 0, sizeof(mesg_t));
+        mesg.kind = BL_MESG;
+        mesg.sender = 1;
+        strcpy(mesg.body, samples[s].body);
+        bench_one(samples[s].label, &mesg, ENC_COMPACT);
+        bench_one(samples[s].label, &mesg, ENC_LZ);
+    }
+
+    printf("\n%-8s %8s %10s %8s %10s %12s\n", "rules", "states", "build ms", "ac ns", "strstr ns", "ac mesg/s");
+    for (int n_rules = 10; n_rules <= 10000; n_rules *= 10) {
+        bench_rules(n_rules);
+    }
+
+    char utf8[MAXLINE] = "";
+    while (strlen(utf8) < MAXLINE - 40) {
+        strcat(utf8, "naïve café → résumé ✓ ");
+    }
+    char escapes[MAXLINE];
+    strcpy(escapes, samples[1].body);
+    for (int i = 0; i + 6 < strlen(escapes); i += 100) {
+        memcpy(escapes + i, "\x1b[2J", 4); // clear screen
+    }
+    bench_scan();
+    printf("\n%-14s %6s %6s %10s\n", "body", "bytes", "fixed", "clean ns");
+    bench_clean("chat line", samples[0].body);
+    bench_clean("log paste", samples[1].body);
+    bench_clean("utf-8", utf8);
+    bench_clean("escapes", escapes);
+    return 0;
+}
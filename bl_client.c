@@ -2,6 +2,7 @@
 // The client must have multiple threads so you will need to implement some worker functions
 // as thread entry points here.
 
+#define _GNU_SOURCE             // splice(), tee() and F_GETPIPE_SZ
 #include <stdio.h>
 #include <unistd.h>
 #include "blather.h"
@@ -20,6 +21,415 @@ pthread_t user_thread;
 pthread_t server_thread;
 simpio_t simpio_actual;
 char pid[100]; // process id, used to name file
+char server_fifo[MAXNAME + 5]; // join FIFO of the server
+int pool_fd = -1; // holds the lock on FIFOs claimed from the server's pool, -1 if the client made its own
+
+// With BL_RECONNECT set the client rejoins when the server shuts down
+// or goes quiet instead of exiting, and asks for a replay of
+// everything after last_seq, the last sequence number displayed.
+int DO_RECONNECT;
+int last_seq;
+int server_secs = DISCONNECT_SECS; // silence after which the server is taken to be gone, its disconnect_secs
+char filters[FILTER_LINES][MAXLINE]; // %filter lines given since the last clear, sent again on rejoining
+int n_filters;
+int n_joined_filters;                // of those, how many the server took with the join request
+pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER; // held while writing to the server or reconnecting
+
+// With BL_TRACE set the client asks for CAP_TRACE, stamps its chat and
+// keeps histograms of how long traced chat from everyone took to reach
+// the screen, shown by %trace.
+lat_hist_t trace_hist[N_TRACE_HOPS];
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // held while using trace_hist
+
+// Send a message to the server over the to-server FIFO. Waits while a
+// reconnect is in progress so the message goes to the new server.
+void client_send(mesg_t *mesg) {
+    pthread_mutex_lock(&conn_lock);
+    PROBE1(client_send, mesg->kind); // before the write, the echo may come back at once
+    long n_write = mesg_write(client->to_server_fd, mesg);
+    check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+// Ask the server to change what this client receives; spec is as for
+// server_set_filter(). Unless resending, spec is remembered to be sent
+// again after a reconnect, up to FILTER_LINES of them; "clear" forgets
+// the rest.
+void client_send_filter(char *spec, int remember) {
+    if (remember) {
+        if (strncmp(spec, "clear", 5) == 0) {
+            n_filters = 0;
+        } else if (n_filters < FILTER_LINES) {
+            strcpy(filters[n_filters++], spec);
+        }
+    }
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg));
+    mesg.kind = BL_FILTER;
+    strcpy(mesg.body, spec);
+    client_send(&mesg);
+}
+
+// Claim a free FIFO pair from the server's pool by locking its client
+// FIFO, a lock kept until the client exits or reconnects, and use its
+// names. Returns 1 if one was claimed and 0 if none was free, in which
+// case the client makes its own.
+int client_claim_pool() {
+    char server_name[MAXNAME + 5];
+    strcpy(server_name, server_fifo);
+    server_name[strlen(server_name) - strlen(".fifo")] = '\0';
+    for (int k = 0; k < POOL_MAX; ++k) {
+        char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+        pool_fifo_names(server_name, k, to_client, to_server);
+        int fd = open(to_client, O_RDONLY | O_NONBLOCK); // does not wait for a writer
+        if (fd == -1) {
+            continue;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0 && strlen(to_client) < MAXPATH) {
+            pool_fd = fd;
+            strcpy(client->to_client_fname, to_client);
+            strcpy(client->to_server_fname, to_server);
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Create and open this client's FIFOs and send a join request to the
+// server asking for the messages after resume_seq, 0 for none, with
+// the %filter lines given so far, then wait for its reply. Returns 0 once accepted, -1 if no server is
+// reading its join FIFO or it does not answer and 1 if the server
+// refused the join, with the reason shown to the user.
+int client_join(int resume_seq) {
+    // use FIFOs the server made ahead or create fifo files
+    if (pool_fd == -1 && !client_claim_pool()) {
+        mkfifo(client->to_server_fname, DEFAULT_PERMS);
+        mkfifo(client->to_client_fname, DEFAULT_PERMS);
+    }
+
+    // opening for write only without blocking fails unless a server is running
+    server_fd = open(server_fifo, O_WRONLY | O_NONBLOCK);
+    if (server_fd == -1) {
+        client->to_server_fd = client->to_client_fd = -1;
+        return -1;
+    }
+    fcntl(server_fd, F_SETFL, 0);
+
+    // open fifo files
+    client->to_server_fd = open(client->to_server_fname, O_RDWR);
+    check_fail(client->to_server_fd == -1, 1, "open to_server fifo error\n");
+
+    client->to_client_fd = open(client->to_client_fname, O_RDWR);
+    check_fail(client->to_client_fd == -1, 1, "open to_client fifo error\n");
+
+    // fill join info
+    join_t join;
+    memset(&join, 0, sizeof(join_t));
+    strcpy(join.name, client->name);
+    strcpy(join.to_client_fname, client->to_client_fname);
+    strcpy(join.to_server_fname, client->to_server_fname);
+    join.last_seq = resume_seq;
+    join.version = PROTO_VERSION;
+    join.caps = CAP_RESUME | CAP_NAMEIDS | CAP_ATTACH | CAP_FILTERS;
+    join.n_filters = n_filters; // in place before the server replays anything
+    memcpy(join.filters, filters, sizeof(filters));
+    if (getenv("BL_NOCOMPRESS") == NULL) {
+        join.caps |= CAP_COMPRESS;
+    }
+    if (getenv("BL_TRACE") != NULL) {
+        join.caps |= CAP_TRACE;
+    }
+    char buf[JOIN_MAX]; // the request, then the reply
+    int len = join_encode(&join, buf);
+    check_fail(len == -1, 0, "name or fifo names too long to join\n");
+    long n_write = write(server_fd, buf, len); // tell server the client is joining
+    check_fail(n_write == -1, 1, "write to %d error.\n", server_fd);
+
+    // the reply is the first message on the to-client FIFO
+    struct pollfd pfd = {.fd = client->to_client_fd, .events = POLLIN};
+    if (poll(&pfd, 1, DISCONNECT_SECS * 1000) <= 0) {
+        return -1;
+    }
+    mesg_t reply;
+    len = frame_read(client->to_client_fd, buf);
+    if (len <= 0 || mesg_decode(buf, len, &reply, NULL) == 0) {
+        return -1;
+    }
+    if (reply.kind == BL_REJECT) {
+        iprintf(simpio, "-- join refused: %s --\n", reply.body);
+        return 1;
+    }
+    client->id = reply.sender;
+    client->caps = reply.seq; // what the server agreed to
+    n_joined_filters = client->caps & CAP_FILTERS ? join.n_filters : 0;
+    if (atoi(reply.body) > 0) {
+        server_secs = atoi(reply.body);
+    }
+    return 0;
+}
+
+// Close whichever of the server and client FIFOs are open.
+void client_close() {
+    int *fds[3] = {&server_fd, &client->to_server_fd, &client->to_client_fd};
+    for (int i = 0; i < 3; ++i) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+// Drop the connection to a server which shut down or stopped pinging
+// and rejoin once a server is running again, retrying every
+// RECONNECT_SECS. Called by the server thread.
+void client_reconnect() {
+    pthread_mutex_lock(&conn_lock);
+    iprintf(simpio, "-- connection lost, reconnecting --\n");
+    client_close();
+    if (pool_fd != -1) { // the pool is the old server's; claim again from the new one
+        close(pool_fd);
+        pool_fd = -1;
+        sprintf(client->to_server_fname, "%s.server.fifo", pid);
+        sprintf(client->to_client_fname, "%s.client.fifo", pid);
+    } else {
+        remove(client->to_server_fname);
+        remove(client->to_client_fname);
+    }
+    int resume_seq = client->caps & CAP_RESUME ? last_seq : 0; // replay only if the server keeps history for us
+    while (client_join(resume_seq) != 0) {
+        client_close();
+        sleep(RECONNECT_SECS);
+    }
+    dbg_printf("reconnected, resuming after %d\n", last_seq);
+    pthread_mutex_unlock(&conn_lock);
+    for (int i = n_joined_filters; i < n_filters; ++i) { // those which did not go with the join
+        client_send_filter(filters[i], 0);
+    }
+}
+
+// Chat read from the log by show_last(), kept between calls so each
+// reads only what was logged since: the latest LAST_MAX messages in a
+// ring, the names of the senders by id and how far the log was read.
+#define LAST_MAX HISTORY_LEN
+mesg_t *last_ring;
+int last_count;
+long last_offset;
+name_table_t last_names;
+
+// Keep the chat in mesg in the ring of show_last().
+void last_add(mesg_t *mesg) {
+    if (mesg->kind == BL_MESG || mesg->kind == BL_CHUNK) { // streamed messages show their first MAXLINE-1 bytes
+        last_ring[last_count++ % LAST_MAX] = *mesg;
+    }
+}
+
+// Start reading the log where the server's snapshot left off, if it has
+// one for this log: the snapshot holds the names as of that point and
+// the latest broadcasts before it. Returns the log offset to read from,
+// the start of the log if there is no usable snapshot.
+long last_from_snapshot() {
+    char snap_name[MAXNAME + 5];
+    strcpy(snap_name, server_fifo);
+    strcpy(snap_name + strlen(snap_name) - strlen(".fifo"), ".snap");
+    FILE *in = fopen(snap_name, "r");
+    if (in == NULL) {
+        return sizeof(who_t);
+    }
+    snap_hdr_t hdr;
+    struct stat st;
+    fstat(log_fd, &st);
+    int ok = fread(&hdr, sizeof(hdr), 1, in) == 1 && hdr.magic == SNAP_MAGIC &&
+             hdr.mesg_size == sizeof(mesg_t) && hdr.log_ino == st.st_ino &&
+             hdr.log_offset >= sizeof(who_t) && hdr.log_offset <= st.st_size &&
+             hdr.hist_count >= 0 && hdr.hist_count <= HISTORY_LEN &&
+             fread(&last_names, sizeof(name_table_t), 1, in) == 1;
+    mesg_t mesg;
+    for (int k = 0; ok && k < hdr.hist_count; ++k) {
+        ok = fread(&mesg, sizeof(mesg_t), 1, in) == 1;
+        if (ok && (mesg.kind != BL_CHUNK || (mesg.flags & WIRE_FIRST))) { // the log holds a stream's first chunk only
+            last_add(&mesg);
+        }
+    }
+    fclose(in);
+    if (!ok) { // torn or for another log, read it all
+        last_count = 0;
+        memset(&last_names, 0, sizeof(last_names));
+        return sizeof(who_t);
+    }
+    return hdr.log_offset;
+}
+
+// Show the last num chat messages in the log, at most LAST_MAX. Logged
+// messages name their sender by id, so the first call reads the log
+// from the server's snapshot, or from the start without one, to learn
+// the names; later calls read only what was added since.
+void show_last(int num) {
+    if (num <= 0) {
+        return;
+    }
+    if (num > LAST_MAX) {
+        num = LAST_MAX;
+    }
+    struct stat st;
+    fstat(log_fd, &st);
+    if (last_ring == NULL || st.st_size < last_offset) { // first call, or the log was started over
+        if (last_ring == NULL) {
+            last_ring = malloc(sizeof(mesg_t) * LAST_MAX);
+            check_fail(last_ring == NULL, 1, "malloc error.\n");
+        }
+        last_count = 0;
+        memset(&last_names, 0, sizeof(last_names));
+        last_offset = last_from_snapshot();
+    }
+    static char buf[RECV_BUFSIZE];
+    int have = 0, used = 0, n_read;
+    while ((n_read = pread(log_fd, buf + have, sizeof(buf) - have, last_offset + have)) > 0) {
+        have += n_read;
+        mesg_t mesg;
+        for (int n; (n = mesg_decode(buf + used, have - used, &mesg, &last_names)) > 0; used += n) {
+            last_add(&mesg);
+        }
+        memmove(buf, buf + used, have - used); // a record still being written is read again next time
+        last_offset += used;
+        have -= used;
+        used = 0;
+    }
+    for (int i = last_count < num ? 0 : last_count - num; i < last_count; ++i) {
+        iprintf(simpio, "[%s] : %s\n", last_ring[i % LAST_MAX].name, last_ring[i % LAST_MAX].body);
+    }
+}
+
+// Stream the text file fname to the room as one message of up to
+// STREAM_MAX bytes, sent in chunks of at most MAXLINE-1 bytes as it is
+// read. Writes block while the server holds the stream back for a busy
+// room. NUL bytes are sent as spaces.
+void client_send_file(char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        iprintf(simpio, "-- cannot open %s --\n", fname);
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    int total = st.st_size < STREAM_MAX ? st.st_size : STREAM_MAX;
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg));
+    mesg.kind = BL_CHUNK;
+    mesg.flags = WIRE_FIRST;
+    mesg.seq = total;
+    for (int sent = 0; !(mesg.flags & WIRE_LAST); ) {
+        int want = total - sent < MAXLINE - 1 ? total - sent : MAXLINE - 1;
+        int n_read = want > 0 ? read(fd, mesg.body, want) : 0;
+        if (n_read <= 0) { // file ended early, finish the stream short
+            n_read = 0;
+            mesg.flags |= WIRE_LAST;
+        } else if (sent + n_read < total) { // leave a split character for the next chunk
+            int whole = utf8_whole_prefix(mesg.body, n_read);
+            lseek(fd, whole - n_read, SEEK_CUR);
+            n_read = whole;
+        }
+        for (int i = 0; i < n_read; ++i) {
+            if (mesg.body[i] == '\0') {
+                mesg.body[i] = ' ';
+            }
+        }
+        mesg.body[n_read] = '\0';
+        sent += n_read;
+        if (sent == total) {
+            mesg.flags |= WIRE_LAST;
+        }
+        client_send(&mesg);
+        mesg.flags &= ~WIRE_FIRST;
+        mesg.seq = 0;
+    }
+    close(fd);
+}
+
+// Send the file fname as an attachment: a BL_ATTACH message with the
+// file's size and name followed by the file's bytes, spliced into the
+// to-server FIFO. Files over ATTACH_MAX are refused here; a file which
+// shrinks while being sent is made up with zeros so the server still
+// gets the size it was told.
+void client_send_attachment(char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        iprintf(simpio, "-- cannot open %s --\n", fname);
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size > ATTACH_MAX) {
+        iprintf(simpio, "-- %s is over %d bytes --\n", fname, ATTACH_MAX);
+        close(fd);
+        return;
+    }
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg));
+    mesg.kind = BL_ATTACH;
+    mesg.seq = st.st_size;
+    char *base = strrchr(fname, '/');
+    strncpy(mesg.body, base != NULL ? base + 1 : fname, MAXLINE - 1);
+
+    pthread_mutex_lock(&conn_lock);
+    long n_write = mesg_write(client->to_server_fd, &mesg);
+    check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);
+    for (long left = st.st_size; left > 0; ) {
+        long n = splice(fd, NULL, client->to_server_fd, NULL, left, SPLICE_F_MOVE);
+        if (n <= 0) { // file shrank
+            static char zeros[4096];
+            n = write(client->to_server_fd, zeros, left < sizeof(zeros) ? left : sizeof(zeros));
+            check_fail(n == -1, 1, "write to fd %d error.\n", client->to_server_fd);
+        }
+        left -= n;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    close(fd);
+}
+
+// Save the attachment announced by mesg as recv-NAME-FILE. Its first
+// bytes may already be in buf, which holds len bytes read after the
+// announcement; the rest is spliced from the to-client FIFO. Returns
+// the number of bytes of buf used.
+int client_save_attachment(mesg_t *mesg, char *buf, int len) {
+    char fname[MAXPATH];
+    int fd = -1;
+    if (snprintf(fname, sizeof(fname), "recv-%s-%s", mesg->name, mesg->body) < sizeof(fname)) {
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd == -1) { // the bytes still have to be taken off the FIFO
+        fd = open("/dev/null", O_WRONLY);
+    }
+    long size = (uint32_t) mesg->seq;
+    int used = len < size ? len : size;
+    check_fail(write(fd, buf, used) != used, 1, "write %s error.\n", fname);
+    for (long left = size - used; left > 0; ) {
+        long n = splice(client->to_client_fd, NULL, fd, NULL, left, SPLICE_F_MOVE);
+        check_fail(n <= 0, 1, "splice attachment error.\n");
+        left -= n;
+    }
+    close(fd);
+    return used;
+}
+
+// Show the latency histograms of traced chat received so far.
+void show_trace() {
+    if (!(client->caps & CAP_TRACE)) {
+        iprintf(simpio, "-- tracing is off: set BL_TRACE and rejoin a server which grants it --\n");
+        return;
+    }
+    char text[N_TRACE_HOPS * MAXLINE];
+    int len = 0;
+    pthread_mutex_lock(&trace_lock);
+    for (int hop = 0; hop < N_TRACE_HOPS; ++hop) {
+        len += hist_format(&trace_hist[hop], hop, text + len, sizeof(text) - len);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (len == 0) {
+        len = snprintf(text, sizeof(text), "-- no traced messages yet --\n");
+    }
+    iwrite(simpio, text, len);
+}
 
 // The user thread performs an input loop until the user has completed a line.
 // It then writes message data into the to-server FIFO to get it to the server
@@ -40,8 +450,7 @@ void *user_worker(void *arg) {
             strcpy(mesg.name, client->name);
             mesg.kind = BL_DEPARTED;
             // sent to the server, tell other client about the leave
-            long n_write = write(client->to_server_fd, &mesg, sizeof(mesg_t));
-            check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);     
+            client_send(&mesg);
             break;
         }
 
@@ -61,17 +470,17 @@ void *user_worker(void *arg) {
             int num = atoi(simpio->buf + 6); // last message number
             dbg_printf("get last %d message.\n", num);
             iprintf(simpio, "====================\n");
-            long offset = lseek(log_fd, 0, SEEK_END);
-            check_fail(offset == -1, 1, "lseek error.\n");
-            offset = offset - num * sizeof(mesg_t);
-            mesg_t mesg;
             iprintf(simpio, "LAST %d MESSAGES\n", num);
-            for (int i = 0; i < num; ++i) {
-                pread(log_fd, &mesg, sizeof(mesg_t), offset);
-                offset += sizeof(mesg_t);
-                iprintf(simpio, "[%s] : %s\n", mesg.name, mesg.body);
-            }
+            show_last(num);
             iprintf(simpio, "====================\n");
+        } else if (strncmp(simpio->buf, "%send ", 6) == 0) {
+            client_send_file(simpio->buf + 6);
+        } else if (strncmp(simpio->buf, "%filter ", 8) == 0) {
+            client_send_filter(simpio->buf + 8, 1);
+        } else if (strncmp(simpio->buf, "%attach ", 8) == 0) {
+            client_send_attachment(simpio->buf + 8);
+        } else if (strncmp(simpio->buf, "%trace", 6) == 0) {
+            show_trace();
         } else {
             mesg_t mesg;
             memset(&mesg, 0, sizeof(mesg));
@@ -84,10 +493,13 @@ void *user_worker(void *arg) {
             } else {
                 mesg.kind = BL_MESG;
             }
+            if (mesg.kind == BL_MESG && (client->caps & CAP_TRACE)) {
+                mesg.flags |= WIRE_TRACE;
+                mesg.trace[TRACE_SENT] = clock_ns();
+            }
 
             // sent to the server
-            long n_write = write(client->to_server_fd, &mesg, sizeof(mesg_t));
-            check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);
+            client_send(&mesg);
         }
 
 
@@ -99,53 +511,134 @@ void *user_worker(void *arg) {
     return NULL;
 }
 
+// Format a message received from the server for display into out
+// which has room for max characters. Returns the number of characters
+// added; kinds which are not displayed add nothing.
+int format_mesg(mesg_t *mesg, char *out, int max) {
+    switch (mesg->kind) {
+        case BL_MESG:
+            return snprintf(out, max, "[%s] : %s\n", mesg->name, mesg->body);
+        case BL_JOINED:
+            return snprintf(out, max, "-- %s JOINED --\n", mesg->name);
+        case BL_DEPARTED: // actually won't happen here
+            return snprintf(out, max, "-- %s DEPARTED --\n", mesg->name);
+        case BL_SHUTDOWN:
+            return snprintf(out, max, "!!! server is shutting down !!!\n");
+        case BL_DISCONNECTED: // TODO ADVANCED
+            return snprintf(out, max, "-- %s DISCONNECTED --\n", mesg->name);
+        case BL_CHUNK: { // shown as it arrives, the name before the first chunk
+            int len = 0;
+            if (mesg->flags & WIRE_FIRST) {
+                len = snprintf(out, max, "[%s] : ", mesg->name);
+            }
+            len += snprintf(out + len, max - len, "%s", mesg->body);
+            if ((mesg->flags & WIRE_LAST) && (len == 0 || out[len - 1] != '\n')) {
+                len += snprintf(out + len, max - len, "\n");
+            }
+            return len;
+        }
+        case BL_ATTACH:
+            return snprintf(out, max, "-- %s sent %s (%u bytes), saved as recv-%s-%s --\n",
+                            mesg->name, mesg->body, (uint32_t) mesg->seq, mesg->name, mesg->body);
+        default:
+            return 0;
+    }
+}
+
+// Count the hops of n traced messages, whose stamps are in traced,
+// shown at display_ns.
+void trace_displayed(int64_t traced[][3], int n, long display_ns) {
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < n; ++i) {
+        hist_add(&trace_hist[TRACE_TO_SERVER], traced[i][TRACE_RECV] - traced[i][TRACE_SENT]);
+        hist_add(&trace_hist[TRACE_SERVER], traced[i][TRACE_QUEUED] - traced[i][TRACE_RECV]);
+        hist_add(&trace_hist[TRACE_TO_DISPLAY], display_ns - traced[i][TRACE_QUEUED]);
+        hist_add(&trace_hist[TRACE_TOTAL], display_ns - traced[i][TRACE_SENT]);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
 // The server thread reads data from the to-client FIFO and prints to the screen
-// as data is read.
+// as data is read. Each read takes everything the FIFO holds, up to
+// RECV_BUFSIZE, decodes every complete message in it and shows them
+// together with one iwrite(); a partial message is kept for the next read.
+// Traced messages count as displayed when the iwrite() showing them
+// returns.
 void *server_worker(void *arg) {
-    while (1) {
+    static char inbuf[RECV_BUFSIZE];        // bytes read but not yet decoded
+    static char text[RECV_BUFSIZE];         // formatted output of this batch
+    static int64_t traced[RECV_BUFSIZE / (sizeof(wire_hdr_t) + TRACE_LEN)][3]; // stamps of traced messages in text
+    static name_table_t names;              // names of senders by id
+    int have = 0;
+    int shutdown = 0;
+    while (!shutdown) {
+        if (DO_RECONNECT && DO_ADVANCED) { // pings stopping means the server is gone
+            struct pollfd pfd = {.fd = client->to_client_fd, .events = POLLIN};
+            if (poll(&pfd, 1, server_secs * 1000) == 0) {
+                client_reconnect();
+                have = 0;
+                continue;
+            }
+        }
+        long n_read = read(client->to_client_fd, inbuf + have, RECV_BUFSIZE - have);
+        if (n_read <= 0) {
+            continue;
+        }
+        have += n_read;
+
+        int off = 0, len = 0, pinged = 0, n_traced = 0;
         mesg_t mesg;
-        memset(&mesg, 0, sizeof(mesg));
-        struct pollfd poll_fds[1];
-        memset(poll_fds, 0, sizeof(poll_fds));
-        
-        poll_fds[0].fd = client->to_client_fd;
-        poll_fds[0].events |= POLLIN;
-        int num = poll(poll_fds, 1, -1);
-        if (num > 0) {
-            if (poll_fds[0].revents & POLLIN) {
-                read(client->to_client_fd, &mesg, sizeof(mesg_t));
-                switch (mesg.kind) {
-                    case BL_MESG:
-                        iprintf(simpio, "[%s] : %s\n", mesg.name, mesg.body);
-                        break;
-                    case BL_JOINED:
-                        iprintf(simpio, "-- %s JOINED --\n", mesg.name);
-                        break;
-                    case BL_DEPARTED: // actually won't happen here
-                        iprintf(simpio, "-- %s DEPARTED --\n", mesg.name);
-                        break;
-                    case BL_SHUTDOWN:
-                        iprintf(simpio, "!!! server is shutting down !!!\n");
-                        break;
-                    case BL_DISCONNECTED: // TODO ADVANCED
-                        iprintf(simpio, "-- %s DISCONNECTED --\n", mesg.name);
-                        break;
-                    case BL_PING:
-                        memset(&mesg, 0, sizeof(mesg));
-                        mesg.kind = BL_PING;
-                        strcpy(mesg.name, client->name);
-                        // response to the server
-                        long n_write = write(client->to_server_fd, &mesg, sizeof(mesg_t));
-                        check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);
-                        break;
+        for (int n; (n = mesg_decode(inbuf + off, have - off, &mesg, &names)) > 0; ) {
+            off += n;
+            PROBE3(client_recv, mesg.kind, mesg.seq, mesg.sender == client->id);
+            if (mesg.kind == BL_ATTACH) { // the file's bytes come next
+                off += client_save_attachment(&mesg, inbuf + off, have - off);
+            }
+            if (len > sizeof(text) - 2 * MAXNAME - 2 * MAXLINE - 64) { // no room for another line
+                iwrite(simpio, text, len);
+                trace_displayed(traced, n_traced, clock_ns());
+                PROBE1(client_display, len);
+                len = 0;
+                n_traced = 0;
+            }
+            len += format_mesg(&mesg, text + len, sizeof(text) - len);
+            if (mesg.flags & WIRE_TRACE) {
+                memcpy(traced[n_traced++], mesg.trace, sizeof(mesg.trace));
+            }
+            if (mesg.seq > 0 && mesg.kind != BL_ATTACH) { // an attachment's seq is its size
+                last_seq = mesg.seq;
+            }
+            if (mesg.kind == BL_PING) {
+                pinged = 1;
+                if (atoi(mesg.body) > 0) { // the server's timeout may have been changed
+                    server_secs = atoi(mesg.body);
                 }
-            }       
-            if(mesg.kind == BL_SHUTDOWN) {
-                pthread_cancel(user_thread);
-                break;
+            } else if (mesg.kind == BL_SHUTDOWN) {
+                shutdown = 1;
             }
         }
+        memmove(inbuf, inbuf + off, have - off);
+        have -= off;
+
+        if (len > 0) {
+            iwrite(simpio, text, len);
+            trace_displayed(traced, n_traced, clock_ns());
+            PROBE1(client_display, len);
+        }
+        if (pinged) { // one response covers every ping in the batch
+            mesg_t mesg;
+            memset(&mesg, 0, sizeof(mesg));
+            mesg.kind = BL_PING; // the server knows who answers from the FIFO
+            // response to the server
+            client_send(&mesg);
+        }
+        if (shutdown && DO_RECONNECT) { // wait for the server to come back
+            client_reconnect();
+            have = 0;
+            shutdown = 0;
+        }
     }
+    pthread_cancel(user_thread);
     return NULL;
 }
 
@@ -155,7 +648,7 @@ void grace_leave(int sig) {
     strcpy(mesg.name, client->name);
     mesg.kind = BL_DEPARTED;
     // sent to the server, tell other client about the leave
-    long n_write = write(client->to_server_fd, &mesg, sizeof(mesg_t));
+    long n_write = mesg_write(client->to_server_fd, &mesg);
     check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_server_fd);
     exit(0);
 }
@@ -167,6 +660,13 @@ void init_simpio(char *name) {
     simpio_set_prompt(simpio, prompt);  // set the prompt
     simpio_reset(simpio); // initialize io
     simpio_noncanonical_terminal_mode();
+
+    // repaint at most BL_FPS times a second, 0 repaints on every message
+    int fps = RENDER_FPS;
+    if (getenv("BL_FPS")) {
+        fps = atoi(getenv("BL_FPS"));
+    }
+    simpio_set_frame_rate(simpio, fps);
 }
 
 int main(int argc, char *argv[]) {
@@ -178,6 +678,9 @@ int main(int argc, char *argv[]) {
     if (getenv("BL_ADVANCED")) {
         DO_ADVANCED = 1;
     }
+    if (getenv("BL_RECONNECT")) {
+        DO_RECONNECT = 1;
+    }
 
     // The client should also handle SIGTERM and SIGINT by shutting down gracefully.
     struct sigaction sa = {};
@@ -192,7 +695,6 @@ int main(int argc, char *argv[]) {
     sprintf(pid, "%d", getpid());
     dbg_printf("server_name: %s    client_name: %s \n", argv[1], argv[2]); // server_name and client_name
 
-    char server_fifo[MAXNAME + 5];
     strcpy(server_fifo, argv[1]);
     strcat(server_fifo, ".fifo"); // server filename filled
 
@@ -204,21 +706,6 @@ int main(int argc, char *argv[]) {
     strcpy(client->to_client_fname, pid);
     strcat(client->to_client_fname, ".client.fifo"); // to_client_fname filled
 
-
-    // create fifo files
-    mkfifo(client->to_server_fname, DEFAULT_PERMS);
-    mkfifo(client->to_client_fname, DEFAULT_PERMS);
-
-    // open fifo files
-    server_fd = open(server_fifo, O_RDWR);
-    check_fail(server_fd == -1, 1, "open server fifo error\n");
-
-    client->to_server_fd = open(client->to_server_fname, O_RDWR);
-    check_fail(client->to_server_fd == -1, 1, "open to_server fifo error\n");
-
-    client->to_client_fd = open(client->to_client_fname, O_RDWR);
-    check_fail(client->to_client_fd == -1, 1, "open to_client fifo error\n");
-
     if (DO_ADVANCED) {
         char log_file[MAXNAME + 5];
         strcpy(log_file, argv[1]);
@@ -228,14 +715,13 @@ int main(int argc, char *argv[]) {
         check_fail(log_fd == -1, 1, "open log file error\n");
     }
 
-    // fill join info
-    join_t join;
-    memset(&join, 0, sizeof(join_t));
-    strcpy(join.name, argv[2]);
-    strcpy(join.to_client_fname, client->to_client_fname);
-    strcpy(join.to_server_fname, client->to_server_fname);
-    long n_write = write(server_fd, &join, sizeof(join_t)); // tell server the client is joining
-    check_fail(n_write == -1, 1, "write to %d error.\n", server_fd);
+    int joined = client_join(0);
+    check_fail(joined == -1, 1, "open server fifo error\n");
+    if (joined == 1) {
+        simpio_flush(simpio);
+        simpio_reset_terminal_mode();
+        return 1;
+    }
 
     // create pthreads
     int user_thread_id = pthread_create(&user_thread,
@@ -248,10 +734,9 @@ int main(int argc, char *argv[]) {
     // waiting for threads end
     pthread_join(user_thread, NULL);
     pthread_join(server_thread, NULL);
+    simpio_flush(simpio); // show output still waiting for its frame
 
-    close(server_fd);
-    close(client->to_server_fd);
-    close(client->to_client_fd);
+    client_close();
 
     return 0;
 }
@@ -7,23 +7,20 @@ server_t server_actual;
 server_t *server = &server_actual;
 int DO_ADVANCED;
 
-// shutting down gracefully.
+// Only counts the request; the main loop shuts the server down once
+// the interrupted poll() returns, and a second request cuts short the
+// wait for clients to read.
 void grace_shutdown(int sig) {
-    dbg_printf("shutdown gracefully.\n");
-    log_printf("poll() completed with return value %d\n", -1);
-    log_printf("poll() interrupted by a signal\n");
-    log_printf("END: server_check_sources()\n");
-    server_shutdown(server);
-    exit(0);
+    server->stopping++;
 }
 
+// The alarm only flags that a ping is due; the main loop does the
+// work so client output queues are never modified from a handler.
+volatile sig_atomic_t ping_due = 0;
+
 void ping_clients(int sig) {
-    dbg_printf("ping clients\n");
-    alarm(1);
-    server_tick(server);
-    dbg_printf("server has ran for %d second.\n", server->time_sec);
-    server_ping_clients(server);
-    server_write_who(server);
+    alarm(server->ping_interval);
+    ping_due = 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -44,25 +41,62 @@ int main(int argc, char *argv[]) {
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGINT, &sa, NULL);
 
-    if (DO_ADVANCED) {
-        // ping
-        struct sigaction sa_ping;
-        sigemptyset(&sa_ping.sa_mask);
-        sa_ping.sa_handler = ping_clients;
-        // sa_ping.sa_flags = SA_RESTART; // restart poll
-        sigaction(SIGALRM, &sa_ping, NULL);
-        alarm(1);
+    // ping, installed always as an admin may turn advanced mode on
+    struct sigaction sa_ping = {};
+    sigemptyset(&sa_ping.sa_mask);
+    sa_ping.sa_handler = ping_clients;
+    // sa_ping.sa_flags = SA_RESTART; // restart poll
+    sigaction(SIGALRM, &sa_ping, NULL);
+
+    // the handlers run only while the server waits in server_poll()
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGALRM);
+    sigprocmask(SIG_BLOCK, &handled, &server->poll_mask);
+
+    // remember the program so an admin upgrade runs its replacement
+    int n = readlink("/proc/self/exe", server->exe_path, MAXPATH - 1);
+    if (n == -1) {
+        strncpy(server->exe_path, argv[0], MAXPATH - 1);
     }
 
     // start server
     server_start(server, argv[1], DEFAULT_PERMS);
+    if (DO_ADVANCED) {
+        alarm(server->ping_interval);
+    }
 
     // infinite loop, quit by handle signal
     while (1) {
         dbg_printf("checking source.\n");
         server_check_sources(server);
+        server_clock(server);
         dbg_printf("check source done.\n");
 
+        if (server->stopping) {
+            dbg_printf("shutdown gracefully.\n");
+            server_shutdown(server);
+            exit(0);
+        }
+
+        if (ping_due) {
+            ping_due = 0;
+            dbg_printf("ping clients\n");
+            server_tick(server);
+            dbg_printf("server has ran for %d second.\n", server->time_sec);
+            server_ping_clients(server);
+            server_write_who(server);
+            server_pool_adjust(server);
+            server_snapshot(server, 0);
+        }
+
+        // admin commands, between rounds of traffic
+        if (server->admin_ready) {
+            server_handle_admin(server);
+        }
+
         // handle join request
         if (server_join_ready(server)) {
             server_handle_join(server);
@@ -75,6 +109,17 @@ int main(int argc, char *argv[]) {
                 server_handle_client(server, i);
             }
         }
+
+        server_adjust_pipes(server);
+
+        // write queued output to clients whose FIFOs drained
+        for (int i = 0; i < server->n_clients; i++) {
+            if (server_get_client(server, i)->write_ready) {
+                server_flush_client(server, i, 0);
+            }
+        }
+        server_drop_stuck(server);
+        server_watch(server, WATCH_LOOP, -1, -1, server->now_ns); // the clock was read after the wait
     }
     return 0;
 }
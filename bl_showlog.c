@@ -14,27 +14,47 @@ int main(int argc, char *argv[]) {
     }
 
     printf("MESSAGES\n");
+    // messages are encoded as on the FIFOs; chat messages carry only
+    // the sender's id whose name is learned from the JOINED before it
+    static name_table_t names;
+    static char buf[RECV_BUFSIZE];
     mesg_t mesg;
-    while (fread(&mesg, sizeof(mesg_t), 1, log)) {
-        switch (mesg.kind) {
-            case BL_MESG:
-                printf("[%s] : %s\n", mesg.name, mesg.body);
-                break;
-            case BL_JOINED:
-                printf("-- %s JOINED --\n", mesg.name);
-                break;
-            case BL_DEPARTED: // actually won't happen here
-                printf("-- %s DEPARTED --\n", mesg.name);
-                break;
-            case BL_SHUTDOWN:
-                printf("!!! server is shutting down !!!\n");
-                break;
-            case BL_DISCONNECTED: // TODO ADVANCED
-                printf("-- %s DISCONNECTED --\n", mesg.name);
-                break;
-            case BL_PING:
-                break;
+    int have = 0, used = 0, n_read;
+    while ((n_read = fread(buf + have, 1, sizeof(buf) - have, log)) > 0) {
+        have += n_read;
+        for (int n; (n = mesg_decode(buf + used, have - used, &mesg, &names)) > 0; used += n) {
+            switch (mesg.kind) {
+                case BL_MESG:
+                    printf("[%s] : %s\n", mesg.name, mesg.body);
+                    break;
+                case BL_JOINED:
+                    printf("-- %s JOINED --\n", mesg.name);
+                    break;
+                case BL_DEPARTED: // actually won't happen here
+                    printf("-- %s DEPARTED --\n", mesg.name);
+                    break;
+                case BL_SHUTDOWN:
+                    printf("!!! server is shutting down !!!\n");
+                    break;
+                case BL_DISCONNECTED: // TODO ADVANCED
+                    printf("-- %s DISCONNECTED --\n", mesg.name);
+                    break;
+                case BL_ATTACH:
+                    printf("-- %s attached a file, kept in %s --\n", mesg.name, mesg.body);
+                    break;
+                case BL_CHUNK: { // a whole streamed message, longer than mesg.body
+                    char *body;
+                    int len = frame_body(buf + used, &body);
+                    printf("[%s] : %.*s%s", mesg.name, len, body, len > 0 && body[len - 1] == '\n' ? "" : "\n");
+                    break;
+                }
+                default:
+                    break;
+            }
         }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+        used = 0;
     }
 
     fclose(log);
@@ -12,6 +12,35 @@
 #include <semaphore.h>
 #include <poll.h>
 #include <limits.h>             // added for NAME_MAX
+#include <stdint.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+
+// USDT probe points for perf and bpftrace, all of provider "blather";
+// probes/ has scripts using them. Each is a nop in the code until a
+// tracer attaches, and compiles to nothing without systemtap's
+// <sys/sdt.h>. Arguments are evaluated either way so keep them cheap.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+#ifdef HAVE_SDT
+#define PROBE0(name) STAP_PROBE(blather, name)
+#define PROBE1(name, a) STAP_PROBE1(blather, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(blather, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(blather, name, a, b, c)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { (void) (a); } while (0)
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif
 
 #define DEBUG 1                 // turn of/off debug printing
 #define PROMPT ">> "            // prompt for client UI
@@ -20,6 +49,9 @@
 #define MAXNAME 256             // max length of user name for clients
 #define MAXPATH 1024            // max length filename paths
 #define MAXCLIENTS 256          // max number of clients accepted
+#define RECV_BUFSIZE 65536      // bytes a client reads from its to-client FIFO per wakeup
+#define RENDER_BUFSIZE 65536    // bytes of client output held for the next terminal frame
+#define RENDER_FPS 60           // default max terminal repaints per second, override with BL_FPS
 
 #define EOT 4                   // ascii code of typical EOF character
 #define DEL 127                 // ascii code of typical backspace key
@@ -28,6 +60,146 @@
 #define DEFAULT_PERMS (S_IRUSR | S_IWUSR |S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 #define ALARM_INTERVAL 1          // seconds between alarm rings and pings to clients
 #define DISCONNECT_SECS 5         // seconds before clients are dropped due to lack of contact
+#define OUTQ_LEN 256              // max frames queued in each outbound lane of a client
+#define JOIN_BUF (2 * PIPE_BUF)   // bytes the server may read past a malformed join request
+#define HISTORY_LEN 1024          // broadcasts kept by the server for replay to reconnecting clients
+#define POOL_MIN 4                // FIFO pairs the server keeps ready for joining clients
+#define POOL_MAX 64               // most FIFO pairs in the pool
+#define POOL_WINDOW 10            // seconds over which joins are counted to size the pool
+#define POOL_GROW 4               // most FIFO pairs made at a time, keeping each round short
+#define PIPE_MIN 16384            // smallest buffer a client FIFO is shrunk to
+#define PIPE_DEFAULT 65536        // buffer of a new FIFO, which pool FIFOs are reset to when claimed
+#define PIPE_ADJUST_SECS 5        // seconds between resizings of client FIFO buffers
+#define NANOS_PER_SEC 1000000000L // nanoseconds in a second of the server clock
+#define DRAIN_SECS 2              // seconds shutdown waits for queued output to reach clients
+#define SNAPSHOT_SECS 60          // ADVANCED: seconds between snapshots of the server's state
+#define ADMIN_FLUSH_MSECS 200     // milliseconds the kick and flush admin commands wait on clients to read
+#define STALL_MSECS 100           // milliseconds of work in one go the watchdog logs as a stall
+#define RECONNECT_SECS 1          // seconds between a client's attempts to rejoin a lost server
+
+// frame_t: encoded message bytes queued for clients; a broadcast
+// creates one frame which is shared by every recipient's lane and
+// freed when the last reference is released
+typedef struct {
+  int refs;                     // number of lanes holding the frame
+  int len;                      // number of bytes in data
+  long queued_ns;               // clock_ns() when a traced message was queued, 0 if not traced
+  int attach_fd;                // BL_ATTACH: read end of the pipe its file comes through, -1 for other frames
+  int attach_eof;               // flag indicating the sender is gone and the rest of the file is zeros
+  long attach_len;              // BL_ATTACH: bytes of file written after data
+  char data[];                  // bytes written to the client
+} frame_t;
+
+// lane_t: ring buffer of frames waiting to be written to a client
+typedef struct {
+  frame_t *frames[OUTQ_LEN];    // queued frames, oldest at head
+  int head;                     // index of oldest frame
+  int count;                    // number of frames queued
+  int off;                      // bytes of the oldest frame already written
+} lane_t;
+
+// mesg_kind_t: Kinds of messages between server/client
+typedef enum {
+  BL_MESG         = 10,         // normal message from client with name/body
+  BL_JOINED       = 20,         // client joined the server, name only
+  BL_DEPARTED     = 30,         // client leaving/left server normally, name only
+  BL_SHUTDOWN     = 40,         // server to client : server is shutting down, no name/body
+  BL_DISCONNECTED = 50,         // ADVANCED: client disconnected abnormally, name only
+  BL_PING         = 60,         // ADVANCED: ping to ask or show liveness, from the server body gives its disconnect_secs
+  BL_NAME         = 70,         // server to client : binds a sender id to a name, not displayed
+  BL_ACCEPT       = 80,         // server to client : join accepted, sender is the client's id, seq the CAP_ flags granted, body disconnect_secs
+  BL_REJECT       = 90,         // server to client : join refused, body gives the reason
+  BL_CHUNK        = 100,        // piece of a streamed message, flags mark the first and last
+  BL_ATTACH       = 110,        // file follows: seq raw bytes after it, body the file's name
+  BL_FILTER       = 120,        // client to server : change what the client receives, body as for server_set_filter()
+} mesg_kind_t;
+
+// mesg_t: struct for messages between server/client
+typedef struct {
+  mesg_kind_t kind;               // kind of message
+  int seq;                        // sequence number stamped on broadcasts by the server, 0 for pings
+  int sender;                     // id the server assigned to the client named, 0 for none
+  int flags;                      // WIRE_FIRST/WIRE_LAST for BL_CHUNK, WIRE_TRACE for traced chat, else 0
+  int64_t trace[3];               // WIRE_TRACE: clock_ns() at the TRACE_SENT, TRACE_RECV and TRACE_QUEUED stamps
+  char name[MAXNAME];             // name of sending client or subject of event
+  char body[MAXLINE];             // body text, possibly empty depending on kind
+} mesg_t;
+
+// mesg_v1_t: message as read and written by version 1 clients
+typedef struct {
+  mesg_kind_t kind;               // kind of message, only BL_MESG to BL_PING
+  char name[MAXNAME];             // name of sending client or subject of event
+  char body[MAXLINE];             // body text, possibly empty depending on kind
+} mesg_v1_t;
+
+// wire_hdr_t: header of the compact encoding of a mesg_t used on the
+// FIFOs and in the log. It is followed by name_len bytes of name and
+// body_len bytes of body, neither terminated, then for WIRE_TRACE the
+// trace stamps. The name is only sent
+// where the receiver may not know the sender's id; chat messages
+// carry just the id which receivers look up in a name_table_t.
+typedef struct {
+  uint8_t kind;                   // mesg_kind_t of the message
+  uint8_t flags;                  // WIRE_ flags
+  uint16_t sender;                // id of the sending client, 0 for none
+  uint32_t seq;                   // sequence number of the message
+  uint16_t name_len;              // bytes of name following the header
+  uint16_t body_len;              // bytes of body following the name
+} wire_hdr_t;
+
+#define WIRE_LZ 0x01            // flag: body is an lz_compress() block of body_len bytes
+#define WIRE_FIRST 0x02         // flag: first chunk of a streamed message
+#define WIRE_LAST 0x04          // flag: last chunk of a streamed message
+#define WIRE_TRACE 0x08         // flag: TRACE_LEN bytes of trace stamps follow the body
+
+#define TRACE_SENT 0            // index in mesg_t.trace: the client wrote it to the server
+#define TRACE_RECV 1            // the server read it
+#define TRACE_QUEUED 2          // the server queued it for the recipients
+#define TRACE_LEN (3 * sizeof(int64_t)) // bytes of stamps after the body of a WIRE_TRACE message
+
+// A streamed message is sent as BL_CHUNK messages of up to MAXLINE-1
+// bytes each. The first chunk from the client gives the total length
+// in seq. In the log the whole message is one BL_CHUNK record flagged
+// first and last with a body of the total length.
+#define STREAM_MAX 32768        // max bytes in a streamed message
+
+#define FRAME_MAX (sizeof(wire_hdr_t) + MAXNAME + MAXLINE + TRACE_LEN) // largest encoded message
+
+// name_table_t: names of senders by id as announced by the server
+typedef struct {
+  char names[MAXCLIENTS + 1][MAXNAME]; // name for each id, ids start at 1
+} name_table_t;
+
+#define MUTE_MAX 8              // names a client can mute
+#define FILTER_LINES 16         // %filter lines a client keeps to send again after reconnecting
+
+// filter_t: what a client has asked to receive, checked for each
+// recipient of a broadcast before anything is queued
+typedef struct {
+  uint32_t kinds;                       // KIND_BIT() of each kind wanted
+  uint8_t muted[MAXCLIENTS / 8 + 1];    // bit per sender id whose chat is dropped
+  char mute_names[MUTE_MAX][MAXNAME];   // names muted, to set the bits of whoever joins with them
+  char keyword[MAXNAME];                // chat must contain this to be received, "" for any
+} filter_t;
+
+#define KIND_BIT(kind) (1u << ((kind) / 10))
+#define FILTER_ALL (~0u)        // kinds of a new client: everything
+#define FILTER_ALWAYS (KIND_BIT(BL_SHUTDOWN) | KIND_BIT(BL_PING) | KIND_BIT(BL_NAME) | \
+                       KIND_BIT(BL_ACCEPT) | KIND_BIT(BL_REJECT)) // kinds no filter stops
+
+// client_stats_t: load a client puts on the server, for the stats and
+// top admin commands
+typedef struct {
+  long mesgs_in;                  // messages read from the client
+  long bytes_in;                  // bytes of them as read, with attachments relayed from the client
+  long mesgs_out;                 // messages written in full to the client
+  long bytes_out;                 // bytes of them as encoded for the client, with attachments relayed to it
+  long pings_missed;              // pings followed by the next with no word from the client
+  int queue_peak;                 // most frames queued for the client at once
+  long joined_ns;                 // server clock when the client joined
+} client_stats_t;
+
+#define TOP_DEFAULT 10            // clients listed by the top admin command unless told
 
 // client_t: data on a client connected to the server
 typedef struct {
@@ -36,46 +208,275 @@ typedef struct {
   int to_server_fd;               // file descriptor to read from to receive from client
   char to_client_fname[MAXPATH];  // name of file (FIFO) to write into send to client
   char to_server_fname[MAXPATH];  // name of file (FIFO) to read from receive from client
+  int id;                         // small number naming this client in messages, unique among clients
+  int version;                    // protocol version agreed with the client
+  int caps;                       // CAP_ flags granted to the client
+  int enc;                        // ENC_ encoding of messages sent to the client
+  int streaming;                  // flag indicating a streamed message from the client is under way
+  int stream_left;                // bytes of the streamed message still to come
+  long stream_rec;                // log offset of the streamed message's record
+  long stream_off;                // log offset for the next chunk of the streamed message, -1 if not logged
+  filter_t filter;                // what the client receives
+  int pool_slot;                  // index of its FIFO pair in the server's pool, -1 if the client made its own
+  int out_pipe;                   // buffer size of to_client_fd
+  int in_pipe;                    // buffer size of to_server_fd
+  int out_peak;                   // most bytes waiting for the client to read since the last resize
+  int in_peak;                    // most bytes waiting for the server to read since the last resize
+  long stalls;                    // stalls the watchdog put down to work for the client
+  long stall_ns;                  // total time of those stalls
+  client_stats_t stats;           // counters of the client's traffic
   int data_ready;                 // flag indicating a mesg_t can be read from to_server_fd
-  int last_contact_time;          // ADVANCED: server time at which last contact was made with client
+  long last_contact_ns;           // server clock when last contact was made with client
+  int write_ready;                // flag indicating to_client_fd can accept more queued output
+  int stuck;                      // flag indicating output was dropped on a full lane, see server_drop_stuck()
+  long attach_left;               // bytes of an attachment still to come from the client, 0 if none is under way
+  long attach_size;               // bytes in that attachment
+  int attach_sink;                // spool file or /dev/null the attachment ends up in
+  int attach_n;                   // number of recipients the attachment is relayed to
+  int attach_to[MAXCLIENTS];      // their ids
+  int attach_pipe[MAXCLIENTS];    // write ends of their private pipes
+  long attach_ahead[MAXCLIENTS];  // bytes copied into each pipe past what was taken from to_server_fd
+  mesg_t attach_rec;              // ADVANCED: log record naming the spool file
+  lane_t ctl_lane;                // queued SHUTDOWN/PING/DISCONNECTED frames, always flushed first
+  lane_t data_lane;               // queued chat and presence frames
 } client_t;
 
+// Kinds of work timed by the watchdog, server_watch(). Each runs with
+// every client waiting on it, so any which runs long is a stall of the
+// whole server. Kinds may nest: a client's message is broadcast and
+// flushed within its handling, and each is counted.
+#define WATCH_LOOP 0            // one turn of the main loop after its wait
+#define WATCH_JOIN 1            // server_handle_join()
+#define WATCH_CLIENT 2          // server_handle_client()
+#define WATCH_BROADCAST 3       // server_broadcast()
+#define WATCH_FLUSH 4           // server_flush_client(), including waits for a deadline
+#define WATCH_LOG 5             // server_log_message(), including the semaphore wait
+#define WATCH_WHO 6             // server_write_who(), including the semaphore wait
+#define WATCH_ADMIN 7           // server_handle_admin()
+#define N_WATCH 8
+
+// Hops of a traced message, each with a lat_hist_t. The server sees
+// the first three, the recipient all but the server write.
+#define TRACE_TO_SERVER 0       // client's send to server's read
+#define TRACE_SERVER 1          // server's read to queueing for recipients
+#define TRACE_WRITE 2           // queueing to the last byte written to a recipient
+#define TRACE_TO_DISPLAY 3      // queueing to the recipient's display
+#define TRACE_TOTAL 4           // client's send to the recipient's display
+#define N_TRACE_HOPS 5
+
+#define HIST_BUCKETS 24         // log2 microsecond buckets, the last for 2^22us (4s) and up
+
+// lat_hist_t: latencies seen on one hop of traced messages
+typedef struct {
+  long count;                   // latencies counted
+  long sum_ns;                  // total of them
+  long max_ns;                  // longest
+  long buckets[HIST_BUCKETS];   // count below 2^b microseconds in bucket b
+} lat_hist_t;
+
+// matcher_t: compiled set of phrases to find in text, see match.c
+typedef struct {
+  uint8_t cls[256];             // class of each byte, 0 for bytes in no pattern
+  int n_classes;                // number of byte classes
+  int n_states;                 // number of automaton states, 0 the start
+  int n_patterns;               // number of patterns compiled
+  int *next;                    // next state for state s and class k at s*n_classes+k
+  int *out;                     // length of the longest pattern ending at each state, 0 for none
+} matcher_t;
+
+// Joining clients may use a FIFO pair made ahead by the server rather
+// than making their own: server_name.pool.K.client.fifo and
+// server_name.pool.K.server.fifo for K below POOL_MAX. A client claims
+// one by taking an flock() on the client FIFO, held while it runs, and
+// names the pair in its join request. The server holds both FIFOs open
+// and on departure keeps them for the next client, emptying them when
+// claimed, instead of removing them, so joining and leaving cost no
+// mkfifo(), open() or unlink().
+#define POOL_NONE 0               // no FIFOs at this index
+#define POOL_FREE 1               // FIFOs ready for a client
+#define POOL_USED 2               // FIFOs in use by a client
+
+// pool_slot_t: one FIFO pair of the pool
+typedef struct {
+  int state;                    // POOL_ state
+  int to_client_fd;             // opened when the FIFOs were made
+  int to_server_fd;
+} pool_slot_t;
+
 // server_t: data pertaining to server operations
 typedef struct {
   char server_name[MAXPATH];    // name of server which dictates file names for joining and logging
   int join_fd;                  // file descriptor of join file/FIFO
   int join_ready;               // flag indicating if a join is available
+  char join_buf[JOIN_BUF];      // bytes read from the join FIFO past a malformed request, see server_handle_join()
+  int join_have;                // bytes held in join_buf
   int n_clients;                // number of clients communicating with server
   client_t client[MAXCLIENTS];  // array of clients populated up to n_clients
-  int start_time_sec;           // ADVANCED: server start unix time stamp
-  int time_sec;                 // ADVANCED: time in seconds since server started
+  int start_time_sec;           // server start unix time stamp
+  int time_sec;                 // time in seconds since server started, from the server clock
+  long now_ns;                  // server clock: CLOCK_MONOTONIC nanoseconds read once per loop, see server_clock()
+  long start_ns;                // server clock when the server started
   int log_fd;                   // ADVANCED: file descriptor for log
   sem_t *log_sem;               // ADVANCED: posix semaphore to control who_t section of log file
+  int last_seq;                 // sequence number of the latest broadcast
+  char id_used[MAXCLIENTS + 1]; // flags for client ids in use, ids start at 1
+  mesg_t history[HISTORY_LEN];  // ring of the latest broadcasts for replay, oldest at hist_start
+  int hist_start;               // index of oldest message in history
+  int hist_count;               // number of messages in history
+  matcher_t *rules;             // phrases masked in chat, NULL for none
+  struct timespec rules_mtime;  // modification time of the rules file loaded
+  long rules_checked;           // server clock when the rules file was last looked at
+  lat_hist_t trace[N_TRACE_HOPS]; // latencies of traced messages by TRACE_ hop, shown in stats
+  long last_ping_ns;            // server clock of the latest ping, 0 before the first
+  long stall_min_ns;            // work taking this long or more is a stall, from STALL_MSECS
+  long stalls[N_WATCH];         // stalls seen by WATCH_ kind of work
+  long stall_ns[N_WATCH];       // total time of those stalls
+  int admin_fd;                 // file descriptor of the admin FIFO, server_name.admin.fifo
+  int admin_ready;              // flag indicating admin commands can be read
+  int ping_interval;            // ADVANCED: seconds between pings, starts at ALARM_INTERVAL
+  int disconnect_secs;          // seconds of silence before a client is dropped, starts at DISCONNECT_SECS
+  char exe_path[MAXPATH];       // program run by the upgrade admin command
+  int snap_time;                // ADVANCED: server time of the latest snapshot
+  pid_t snap_pid;               // ADVANCED: process writing a snapshot, 0 if none
+  volatile sig_atomic_t stopping; // count of SIGINT/SIGTERM received, set by the handler only
+  sigset_t poll_mask;           // signal mask while waiting; the handled signals are blocked otherwise
+  long drain_end;               // clock_ns() time shutdown stops waiting on clients, 0 before
+  pool_slot_t pool[POOL_MAX];   // FIFO pairs made ahead for joining clients
+  int pool_free;                // number of POOL_FREE slots
+  int pool_target;              // free slots wanted, from the recent join rate
+  int pool_joins;               // joins since pool_window began
+  long pool_window;             // server clock at the start of the current count of joins
+  int pipe_max;                 // largest FIFO buffer allowed, from /proc/sys/fs/pipe-max-size
+  long pipes_adjusted;          // server clock when client FIFO buffers were last resized
 } server_t;
 
+// ADVANCED: server_name.snap holds what a server would otherwise learn
+// by reading its whole log at start: a snap_hdr_t, the names of the
+// senders by id as of log_offset, then hist_count mesg_t of history
+// oldest first. On start the log is read only from log_offset on.
+#define SNAP_MAGIC 0x424C534E     // "BLSN", bumped if the layout changes
+#define SNAP_CHECK 256            // log bytes before log_offset checksummed to tie a snapshot to its log
+
+// snap_hdr_t: start of a snapshot file
+typedef struct {
+  uint32_t magic;               // SNAP_MAGIC
+  uint32_t mesg_size;           // sizeof(mesg_t) when written
+  uint64_t log_ino;             // inode of the log
+  int64_t log_offset;           // log bytes covered by the snapshot
+  uint32_t log_sum;             // checksum of the SNAP_CHECK log bytes before log_offset
+  uint32_t sum;                 // checksum of everything after the header
+  int32_t last_seq;
+  int32_t hist_count;
+} snap_hdr_t;
+
+// A running server hands its state to the program replacing it over a
+// SOCK_SEQPACKET socket named in BL_UPGRADE_FD: one upgrade_t carrying
+// the join, admin and log fds, then per client an upgrade_client_t
+// carrying its two FIFO fds followed by its queued frames, control
+// lane first, then the history oldest first as mesg_t. The new server
+// answers with one byte once it has everything.
+#define UPGRADE_MAGIC 0x424C5553  // "BLUP" + 3, bumped if upgrade_t or upgrade_client_t change
+
+// upgrade_t: server wide state handed over on upgrade
+typedef struct {
+  int magic;                    // UPGRADE_MAGIC
+  int pid;                      // process sending the state, reaped by the new server
+  int advanced;                 // DO_ADVANCED, may have been changed by an admin
+  int n_clients;                // number of upgrade_client_t which follow
+  int hist_count;               // number of history mesg_t which follow them
+  int last_seq;
+  int start_time_sec;
+  long start_ns;                // CLOCK_MONOTONIC is system wide so clock values carry over
+  int ping_interval;
+  int disconnect_secs;
+  char id_used[MAXCLIENTS + 1];
+} upgrade_t;
+
+// upgrade_client_t: one client handed over on upgrade
+typedef struct {
+  char name[MAXPATH];
+  char to_client_fname[MAXPATH];
+  char to_server_fname[MAXPATH];
+  int id;
+  int version;
+  int caps;
+  int enc;
+  int streaming;
+  int stream_left;
+  long stream_rec;
+  long stream_off;
+  filter_t filter;
+  int pool_slot;
+  long last_contact_ns;
+  client_stats_t stats;
+  int ctl_count;                // frames queued on the control lane
+  int ctl_off;                  // bytes of the first of them already written
+  int data_count;               // frames queued on the data lane
+  int data_off;
+} upgrade_client_t;
+
 // join_t: structure for requests to join the chat room
 typedef struct {
   char name[MAXPATH];            // name of the client joining the server
   char to_client_fname[MAXPATH]; // name of file server writes to to send to client
   char to_server_fname[MAXPATH]; // name of file client writes to to send to server
+  int last_seq;                  // rejoining: last sequence number seen, messages after it are replayed; 0 for a new join
+  int version;                   // protocol version of the client
+  int caps;                      // CAP_ flags of features the client supports
+  int n_filters;                 // CAP_FILTERS: number of filters
+  char filters[FILTER_LINES][MAXLINE]; // %filter lines to apply before anything is replayed
 } join_t;
 
-// mesg_kind_t: Kinds of messages between server/client
-typedef enum {
-  BL_MESG         = 10,         // normal message from client with name/body
-  BL_JOINED       = 20,         // client joined the server, name only
-  BL_DEPARTED     = 30,         // client leaving/left server normally, name only
-  BL_SHUTDOWN     = 40,         // server to client : server is shutting down, no name/body
-  BL_DISCONNECTED = 50,         // ADVANCED: client disconnected abnormally, name only
-  BL_PING         = 60,         // ADVANCED: ping to ask or show liveness
-} mesg_kind_t;
+// join_hdr_t: header of a join request as written to the join FIFO.
+// It is followed by len bytes holding the name and the to-client and
+// to-server FIFO names, each terminated by a NUL, then by n_filters
+// %filter lines terminated the same way. Requests are at most
+// JOIN_MAX bytes, well below PIPE_BUF, so each is written atomically
+// and concurrent joins never interleave. The server replies with
+// BL_ACCEPT or BL_REJECT as the first message on the to-client FIFO.
+typedef struct {
+  uint16_t magic;                // JOIN_MAGIC, marks the start of a request
+  uint16_t len;                  // bytes of names following the header
+  uint8_t version;               // protocol version of the client
+  uint8_t n_filters;             // %filter lines after the names
+  uint8_t unused[2];             // 0
+  uint32_t caps;                 // CAP_ flags of features the client supports
+  uint32_t last_seq;             // rejoining: replay messages after this one
+} join_hdr_t;
 
-// mesg_t: struct for messages between server/client
+#define JOIN_MAGIC 0xB1A7       // first bytes of every join request
+#define JOIN_MAX 2048           // max bytes in a join request including header
+#define PROTO_VERSION 2         // protocol version spoken by this build, 1 is raw join_v1_t/mesg_v1_t
+
+// capability flags sent by clients in join requests
+#define CAP_RESUME  0x01        // understands sequence numbers and replay after last_seq
+#define CAP_NAMEIDS 0x02        // understands compact messages naming senders by id
+#define CAP_COMPRESS 0x04       // understands WIRE_LZ compressed bodies
+#define CAP_ATTACH  0x08        // accepts BL_ATTACH and the file bytes after it
+#define CAP_TRACE   0x10        // stamps its chat and accepts WIRE_TRACE messages, see trace.c
+#define CAP_FILTERS 0x20        // sends its %filter lines with the join request so replay is filtered
+#define SERVER_CAPS (CAP_RESUME | CAP_NAMEIDS | CAP_COMPRESS | CAP_ATTACH | CAP_TRACE | CAP_FILTERS) // capabilities this server can grant
+
+#define ATTACH_MAX (8 << 20)    // max bytes in an attachment
+
+// Encodings of messages sent to clients. A broadcast is encoded at
+// most once per encoding in use and the bytes shared by all clients
+// using it; each client's encoding follows from its version and caps.
+#define ENC_LEGACY  0           // raw mesg_v1_t for version 1 clients
+#define ENC_COMPACT 1           // wire_hdr_t encoding
+#define ENC_LZ      2           // wire_hdr_t encoding with large bodies compressed
+#define ENC_NAMED   3           // wire_hdr_t encoding naming every sender, without CAP_NAMEIDS
+#define ENC_NAMED_LZ 4          // ENC_NAMED with large bodies compressed
+#define N_ENC       5           // number of encodings
+
+#define COMPRESS_MIN 256        // bodies shorter than this are not worth compressing
+
+// join_v1_t: join request written by version 1 clients
 typedef struct {
-  mesg_kind_t kind;               // kind of message
-  char name[MAXNAME];             // name of sending client or subject of event
-  char body[MAXLINE];             // body text, possibly empty depending on kind
-} mesg_t;
+  char name[MAXPATH];            // name of the client joining the server
+  char to_client_fname[MAXPATH]; // name of file server writes to to send to client
+  char to_server_fname[MAXPATH]; // name of file client writes to to send to server
+} join_v1_t;
 
 // who_t: data to write into server log for current clients (ADVANCED)
 typedef struct {
@@ -92,6 +493,14 @@ typedef struct{
   int end_of_input;             // flag determining if end of input has been indicated
   FILE *infile;                 // FILE to read from for input, usually stdin
   FILE *outfile;                // FILE to write to for output, usually stdout
+  char inbuf[MAXLINE];          // input read but not yet processed
+  int in_pos;                   // position of next unprocessed character in inbuf
+  int in_len;                   // number of characters in inbuf
+  char pending[RENDER_BUFSIZE]; // output waiting to be shown in the next frame
+  int pending_len;              // number of bytes in pending
+  int dirty;                    // flag indicating a frame must be drawn
+  long frame_nanos;             // min nanoseconds between frames, 0 draws every output at once
+  long last_frame;              // CLOCK_MONOTONIC nanoseconds when the last frame was drawn
 } simpio_t;
 
 
@@ -102,16 +511,62 @@ void server_shutdown(server_t *server);
 int server_add_client(server_t *server, join_t *join);
 int server_remove_client(server_t *server, int idx);
 void server_broadcast(server_t *server, mesg_t *mesg);
+frame_t *frame_new(void *data, int len);
+void frame_release(frame_t *frame);
+int mesg_is_control(mesg_kind_t kind);
+int mesg_is_history(mesg_kind_t kind);
+int server_enqueue(server_t *server, int idx, frame_t *frame, int ctl);
+int server_flush_client(server_t *server, int idx, int block);
+int server_flush_until(server_t *server, int idx, long deadline_ns);
+int server_client_pending(server_t *server, int idx);
+int server_poll(server_t *server, struct pollfd *pfds, int n, int timeout_ms);
 void server_check_sources(server_t *server);
 int server_join_ready(server_t *server);
 void server_handle_join(server_t *server);
 int server_client_ready(server_t *server, int idx);
 void server_handle_client(server_t *server, int idx);
+long server_clock(server_t *server);
+void server_watch(server_t *server, int what, int idx, int fd, long start_ns);
 void server_tick(server_t *server);
 void server_ping_clients(server_t *server);
 void server_remove_disconnected(server_t *server, int disconnect_secs);
 void server_write_who(server_t *server);
 void server_log_message(server_t *server, mesg_t *mesg);
+void server_history_add(server_t *server, mesg_t *mesg);
+void server_replay(server_t *server, int idx, int after_seq);
+void server_load_history(server_t *server, long offset, name_table_t *names);
+int server_write_snapshot(server_t *server, long log_offset);
+void server_snapshot(server_t *server, int now);
+long server_load_snapshot(server_t *server, name_table_t *names);
+void server_send_client(server_t *server, int idx, mesg_t *mesg);
+void server_reject_join(server_t *server, join_t *join, char *reason);
+void server_stream_chunk(server_t *server, int idx, mesg_t *mesg);
+int server_output_backlog(server_t *server);
+void server_relay_attachment(server_t *server, int idx, mesg_t *mesg);
+void server_relay_input(server_t *server, int idx);
+void server_relay_end(server_t *server, int idx);
+int server_filter_pass(filter_t *filter, mesg_t *mesg);
+void server_set_filter(server_t *server, int idx, char *spec);
+void server_check_rules(server_t *server);
+void server_open_log(server_t *server);
+void server_close_log(server_t *server);
+void server_handle_admin(server_t *server);
+void server_admin_command(server_t *server, char *line);
+void server_kick(server_t *server, char *name);
+void server_disconnect_client(server_t *server, int idx);
+void server_drop_stuck(server_t *server);
+void server_write_stats(server_t *server);
+void server_write_top(server_t *server, int n, char *key);
+int server_upgrade(server_t *server, char *path);
+void server_pool_start(server_t *server);
+void server_pool_adjust(server_t *server);
+void server_pool_close(server_t *server);
+int server_pool_claim(server_t *server, client_t *client);
+void server_pool_release(server_t *server, client_t *client);
+int pipe_max_size();
+void server_pipe_sizes(server_t *server, client_t *client);
+void server_adjust_pipes(server_t *server);
+void server_resume(server_t *server, int sock);
 
 // simpio.c
 void simpio_noncanonical_terminal_mode();
@@ -120,6 +575,44 @@ void simpio_reset(simpio_t *simpio);
 void simpio_set_prompt(simpio_t *simpio, char *prompt);
 void simpio_get_char(simpio_t *simpio);
 void iprintf(simpio_t *simpio, char *fmt, ...);
+void iwrite(simpio_t *simpio, char *text, int len);
+void simpio_set_frame_rate(simpio_t *simpio, int fps);
+void simpio_flush(simpio_t *simpio);
+
+// proto.c
+int mesg_encode(mesg_t *mesg, int with_name, char *buf);
+int mesg_decode(char *buf, int len, mesg_t *mesg, name_table_t *names);
+int frame_read(int fd, char *buf);
+int mesg_write(int fd, mesg_t *mesg);
+int mesg_encode_for(mesg_t *mesg, int enc, int with_name, char *buf);
+int client_encoding(int version, int caps);
+int join_encode(join_t *join, char *buf);
+int join_size(char *buf);
+int join_decode(char *buf, int len, join_t *join);
+int frame_body(char *buf, char **body);
+void pool_fifo_names(char *server_name, int k, char *to_client, char *to_server);
+
+// match.c
+matcher_t *matcher_build(char **patterns, int n);
+matcher_t *matcher_load(char *fname);
+void matcher_free(matcher_t *m);
+int matcher_mask(matcher_t *m, char *text);
+
+// sanitize.c
+int text_ascii_prefix_scalar(const char *text, int len);
+int text_ascii_prefix(const char *text, int len);
+int utf8_seq_len(const uint8_t *s, int len);
+int text_sanitize(char *text, int max, int keep_len);
+int utf8_whole_prefix(const char *text, int len);
+
+// trace.c
+long clock_ns();
+void hist_add(lat_hist_t *hist, long ns);
+int hist_format(lat_hist_t *hist, int hop, char *out, int max);
+
+// lz.c
+int lz_compress(const char *src, int len, char *dst, int cap);
+int lz_decompress(const char *src, int len, char *dst, int cap);
 
 // util.c
 void check_fail(int condition, int perr, char *fmt, ...);
@@ -0,0 +1,170 @@
+// Small LZ77 block codec in the style of LZ4 used to compress large
+// message bodies sent to clients which negotiated CAP_COMPRESS.
+//
+// A block is a run of sequences. Each starts with a token byte whose
+// high nibble is the count of literal bytes and low nibble the match
+// length less LZ_MIN_MATCH; a nibble of 15 is followed by more length
+// bytes, each added in, until one below 255. The literals come next,
+// then a 2-byte little-endian offset back into the output and any
+// match length bytes. The last sequence has literals only and ends the
+// block.
+
+#include "blather.h"
+
+#define LZ_MIN_MATCH 4          // shortest match encoded
+#define LZ_TAIL 5               // the last bytes of the input are always literals
+#define LZ_HASH_BITS 12         // log2 of entries in the match finder's table
+#define LZ_MAX_OFFSET 65535     // furthest back a match can start
+
+// Hash of the 4 bytes at p into the match finder's table.
+static uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the extra bytes for a length of len whose nibble was 15.
+// Returns the new output position or NULL if out of room.
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, int len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Write one sequence of n_lit literals from lit and, if mlen is
+// non-zero, a match of mlen bytes at off back. Returns the new output
+// position or NULL if out of room.
+static uint8_t *lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, int n_lit, int off, int mlen) {
+    if (op >= oend) {
+        return NULL;
+    }
+    int mcode = mlen > 0 ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *token = op++;
+    *token = (n_lit < 15 ? n_lit : 15) << 4 | (mcode < 15 ? mcode : 15);
+    if (n_lit >= 15 && (op = lz_put_len(op, oend, n_lit)) == NULL) {
+        return NULL;
+    }
+    if (n_lit > oend - op) {
+        return NULL;
+    }
+    memcpy(op, lit, n_lit);
+    op += n_lit;
+    if (mlen == 0) {
+        return op;
+    }
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = off & 0xFF;
+    *op++ = off >> 8;
+    if (mcode >= 15 && (op = lz_put_len(op, oend, mcode)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+// Compress the len bytes at src into dst which has room for cap bytes.
+// Returns the compressed length or 0 if it would not fit in cap, which
+// callers use to keep data that does not shrink as it is.
+int lz_compress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *in = (const uint8_t *) src;
+    const uint8_t *ip = in, *anchor = in, *iend = in + len;
+    uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+    int table[1 << LZ_HASH_BITS];     // position + 1 of the last 4 bytes with each hash
+    memset(table, 0, sizeof(table));
+
+    while (iend - ip >= LZ_MIN_MATCH + LZ_TAIL) {
+        uint32_t h = lz_hash(ip);
+        int cand = table[h] - 1;
+        table[h] = ip - in + 1;
+        if (cand < 0 || ip - in - cand > LZ_MAX_OFFSET || memcmp(in + cand, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        const uint8_t *mp = in + cand;
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < iend - LZ_TAIL && mp[mlen] == ip[mlen]) {
+            mlen++;
+        }
+        op = lz_emit(op, oend, anchor, ip - anchor, ip - mp, mlen);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    op = lz_emit(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t *) dst;
+}
+
+// Read the extra bytes of a length whose nibble was 15 and add them to
+// *len. Returns the new input position or NULL if the input ends.
+static const uint8_t *lz_get_len(const uint8_t *ip, const uint8_t *iend, int *len) {
+    int b;
+    do {
+        if (ip >= iend) {
+            return NULL;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+// Decompress the len bytes of a block at src into dst which has room
+// for cap bytes. Returns the decompressed length or -1 if the block is
+// malformed or would overrun dst.
+int lz_decompress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *ip = (const uint8_t *) src, *iend = ip + len;
+    uint8_t *out = (uint8_t *) dst, *op = out, *oend = out + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int n_lit = token >> 4;
+        if (n_lit == 15 && (ip = lz_get_len(ip, iend, &n_lit)) == NULL) {
+            return -1;
+        }
+        if (n_lit > iend - ip || n_lit > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+        if (ip == iend) {               // last sequence, literals only
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && (ip = lz_get_len(ip, iend, &mlen)) == NULL) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > op - out || mlen > oend - op) {
+            return -1;
+        }
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            for (const uint8_t *mp = op - off; mlen > 0; --mlen) { // bytewise, the match overlaps itself
+                *op++ = *mp++;
+            }
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,141 @@
+// Multi-pattern matcher used to mask banned phrases in chat. The
+// patterns are compiled into an Aho-Corasick automaton stored as a
+// full transition table over byte classes: bytes which appear in no
+// pattern share one class, and upper case letters share the class of
+// their lower case form so matching ignores ASCII case. Matching reads
+// each byte of the text once whatever the number of patterns.
+
+#include "blather.h"
+
+// Compile the n patterns into a matcher. Empty patterns are skipped.
+matcher_t *matcher_build(char **patterns, int n) {
+    matcher_t *m = calloc(1, sizeof(matcher_t));
+    check_fail(m == NULL, 1, "calloc matcher error.\n");
+    int max_states = 1;
+    for (int p = 0; p < n; ++p) {
+        for (char *c = patterns[p]; *c != '\0'; ++c) {
+            uint8_t b = tolower((uint8_t) *c);
+            if (m->cls[b] == 0) {
+                m->cls[b] = ++m->n_classes;
+            }
+            max_states++;
+        }
+    }
+    m->n_classes++; // class 0 for bytes in no pattern
+    for (int b = 'A'; b <= 'Z'; ++b) {
+        m->cls[b] = m->cls[tolower(b)];
+    }
+
+    int nc = m->n_classes;
+    m->next = malloc(sizeof(int) * max_states * nc);
+    m->out = calloc(max_states, sizeof(int));
+    check_fail(m->next == NULL || m->out == NULL, 1, "malloc matcher error.\n");
+    memset(m->next, -1, sizeof(int) * max_states * nc);
+    m->n_states = 1;
+    for (int p = 0; p < n; ++p) { // the trie of the patterns
+        int s = 0, len = 0;
+        for (char *c = patterns[p]; *c != '\0'; ++c, ++len) {
+            int *t = &m->next[s * nc + m->cls[(uint8_t) *c]];
+            if (*t == -1) {
+                *t = m->n_states++;
+            }
+            s = *t;
+        }
+        if (len > m->out[s]) {
+            m->out[s] = len;
+        }
+    }
+    m->n_patterns = n;
+
+    // Breadth first from the root: each state's failure state is the
+    // longest proper suffix of its string in the trie; missing edges
+    // follow the failure state's and output is the longest pattern
+    // ending at the state or any of its suffixes.
+    int *fail = malloc(sizeof(int) * m->n_states);
+    int *queue = malloc(sizeof(int) * m->n_states);
+    check_fail(fail == NULL || queue == NULL, 1, "malloc matcher error.\n");
+    int head = 0, tail = 0;
+    for (int k = 0; k < nc; ++k) {
+        int t = m->next[k];
+        if (t == -1) {
+            m->next[k] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        int s = queue[head++];
+        if (m->out[fail[s]] > m->out[s]) {
+            m->out[s] = m->out[fail[s]];
+        }
+        for (int k = 0; k < nc; ++k) {
+            int t = m->next[s * nc + k];
+            int f = m->next[fail[s] * nc + k];
+            if (t == -1) {
+                m->next[s * nc + k] = f;
+            } else {
+                fail[t] = f;
+                queue[tail++] = t;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return m;
+}
+
+// Compile the patterns in the file fname, one per line; blank lines
+// and lines starting with # are skipped. Returns NULL if the file
+// cannot be read.
+matcher_t *matcher_load(char *fname) {
+    FILE *file = fopen(fname, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    int n = 0, max = 64;
+    char **patterns = malloc(sizeof(char *) * max);
+    char line[MAXLINE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (n == max) {
+            max *= 2;
+            patterns = realloc(patterns, sizeof(char *) * max);
+        }
+        patterns[n++] = strdup(line);
+    }
+    fclose(file);
+    matcher_t *m = matcher_build(patterns, n);
+    for (int p = 0; p < n; ++p) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    return m;
+}
+
+void matcher_free(matcher_t *m) {
+    if (m == NULL) {
+        return;
+    }
+    free(m->next);
+    free(m->out);
+    free(m);
+}
+
+// Overwrite every match of a pattern in text with '*' in one pass.
+// Returns the number of places a match ended.
+int matcher_mask(matcher_t *m, char *text) {
+    int s = 0, hits = 0, nc = m->n_classes;
+    for (int i = 0; text[i] != '\0'; ++i) {
+        s = m->next[s * nc + m->cls[(uint8_t) text[i]]];
+        int len = m->out[s];
+        if (len > 0) { // the longest covers any shorter match ending here
+            memset(text + i - len + 1, '*', len);
+            hits++;
+        }
+    }
+    return hits;
+}
@@ -0,0 +1,286 @@
+// Compact encoding of mesg_t used between server and clients and in
+// the log. See wire_hdr_t in blather.h for the layout.
+
+#include "blather.h"
+
+// Encode mesg into buf which must have room for FRAME_MAX bytes. The
+// name is included only if with_name is non-zero. Returns the number
+// of bytes in the encoding.
+int mesg_encode(mesg_t *mesg, int with_name, char *buf) {
+    wire_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.kind = mesg->kind;
+    hdr.sender = mesg->sender;
+    hdr.seq = mesg->seq;
+    hdr.flags = mesg->flags & (WIRE_FIRST | WIRE_LAST | WIRE_TRACE);
+    hdr.name_len = with_name ? strnlen(mesg->name, MAXNAME - 1) : 0;
+    hdr.body_len = strnlen(mesg->body, MAXLINE - 1);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), mesg->name, hdr.name_len);
+    memcpy(buf + sizeof(hdr) + hdr.name_len, mesg->body, hdr.body_len);
+    int len = sizeof(hdr) + hdr.name_len + hdr.body_len;
+    if (hdr.flags & WIRE_TRACE) {
+        memcpy(buf + len, mesg->trace, TRACE_LEN);
+        len += TRACE_LEN;
+    }
+    return len;
+}
+
+// Decode the message at the start of the len bytes in buf into mesg.
+// Returns the number of bytes used or 0 if buf does not yet hold a
+// whole message. If names is given, JOINED and NAME messages record
+// the sender's name in it and messages without a name get the
+// sender's name from it.
+int mesg_decode(char *buf, int len, mesg_t *mesg, name_table_t *names) {
+    wire_hdr_t hdr;
+    if (len < sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    int total = sizeof(hdr) + hdr.name_len + hdr.body_len;
+    int trace_at = total;
+    if (hdr.flags & WIRE_TRACE) {
+        total += TRACE_LEN;
+    }
+    if (len < total) {
+        return 0;
+    }
+    memset(mesg, 0, sizeof(mesg_t));
+    mesg->kind = hdr.kind;
+    mesg->sender = hdr.sender;
+    mesg->seq = hdr.seq;
+    mesg->flags = hdr.flags & (WIRE_FIRST | WIRE_LAST | WIRE_TRACE);
+    if (hdr.flags & WIRE_TRACE) {
+        memcpy(mesg->trace, buf + trace_at, TRACE_LEN);
+    }
+    memcpy(mesg->name, buf + sizeof(hdr), hdr.name_len < MAXNAME ? hdr.name_len : MAXNAME - 1);
+    if (hdr.flags & WIRE_LZ) {
+        if (lz_decompress(buf + sizeof(hdr) + hdr.name_len, hdr.body_len, mesg->body, MAXLINE - 1) == -1) {
+            dbg_printf("mesg_decode: bad compressed body in message %d\n", hdr.seq);
+            mesg->body[0] = '\0';
+        }
+    } else {
+        memcpy(mesg->body, buf + sizeof(hdr) + hdr.name_len, hdr.body_len < MAXLINE ? hdr.body_len : MAXLINE - 1);
+    }
+
+    if (names != NULL && mesg->sender > 0 && mesg->sender <= MAXCLIENTS) {
+        if (hdr.name_len > 0 && (mesg->kind == BL_JOINED || mesg->kind == BL_NAME)) {
+            strcpy(names->names[mesg->sender], mesg->name);
+        } else if (hdr.name_len == 0) {
+            strcpy(mesg->name, names->names[mesg->sender]);
+        }
+    }
+    return total;
+}
+
+// Read one encoded message from fd into buf which must have room for
+// FRAME_MAX bytes: the header and then the rest. Messages are written
+// whole with one write() of at most PIPE_BUF bytes, so the rest is
+// available once the header is; a frame which is short, even for now,
+// is malformed and is not waited for, as a reader holding the FIFO
+// open for writing itself would wait forever. Returns the number of
+// bytes read, 0 at end of file and -1 on error.
+int frame_read(int fd, char *buf) {
+    long n_read = read(fd, buf, sizeof(wire_hdr_t));
+    if (n_read <= 0) {
+        return n_read;
+    }
+    if (n_read < sizeof(wire_hdr_t)) {
+        return -1;
+    }
+    wire_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    int rest = hdr.name_len + hdr.body_len + (hdr.flags & WIRE_TRACE ? TRACE_LEN : 0);
+    int avail = 0;
+    if (rest > FRAME_MAX - sizeof(wire_hdr_t) || ioctl(fd, FIONREAD, &avail) == -1 || avail < rest) {
+        return -1;
+    }
+    int got = 0;
+    while (got < rest) {
+        n_read = read(fd, buf + sizeof(hdr) + got, rest - got);
+        if (n_read <= 0) {
+            return -1;
+        }
+        got += n_read;
+    }
+    return sizeof(hdr) + rest;
+}
+
+// Encode mesg without a name and write it to fd with a single write().
+// Used by clients whose name the server already knows. Returns the
+// result of write().
+int mesg_write(int fd, mesg_t *mesg) {
+    char buf[FRAME_MAX];
+    int len = mesg_encode(mesg, 0, buf);
+    return write(fd, buf, len);
+}
+
+// Encode a join request into buf which must have room for JOIN_MAX
+// bytes. The filters go in while there is room; join->n_filters is
+// cut down to those which did. Returns the number of bytes in the
+// request or -1 if the names are too long to fit.
+int join_encode(join_t *join, char *buf) {
+    join_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JOIN_MAGIC;
+    hdr.version = join->version;
+    hdr.caps = join->caps;
+    hdr.last_seq = join->last_seq;
+    char *names[3] = {join->name, join->to_client_fname, join->to_server_fname};
+    int off = sizeof(hdr);
+    for (int i = 0; i < 3; ++i) {
+        int len = strlen(names[i]) + 1;
+        if (off + len > JOIN_MAX) {
+            return -1;
+        }
+        memcpy(buf + off, names[i], len);
+        off += len;
+    }
+    for (hdr.n_filters = 0; hdr.n_filters < join->n_filters; hdr.n_filters++) {
+        int len = strlen(join->filters[hdr.n_filters]) + 1;
+        if (off + len > JOIN_MAX) {
+            break;
+        }
+        memcpy(buf + off, join->filters[hdr.n_filters], len);
+        off += len;
+    }
+    join->n_filters = hdr.n_filters;
+    hdr.len = off - sizeof(hdr);
+    memcpy(buf, &hdr, sizeof(hdr));
+    return off;
+}
+
+// Returns the number of bytes in the join request starting at buf,
+// which holds at least sizeof(join_hdr_t) bytes, or -1 if none can
+// start there. A request which does not start with JOIN_MAGIC is taken
+// as the join_v1_t of a version 1 client.
+int join_size(char *buf) {
+    join_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != JOIN_MAGIC) {
+        return sizeof(join_v1_t);
+    }
+    if (hdr.len > JOIN_MAX - sizeof(hdr)) {
+        return -1;
+    }
+    return sizeof(hdr) + hdr.len;
+}
+
+// Decode the join request of len bytes at buf, as join_size() gives,
+// into join. A join_v1_t is given version 1 with no caps. Returns 0 on
+// success and -1 if the request is not well formed.
+int join_decode(char *buf, int len, join_t *join) {
+    join_hdr_t hdr;
+    memset(join, 0, sizeof(join_t));
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != JOIN_MAGIC) { // version 1, the header is the start of join_v1_t
+        join_v1_t old;
+        memcpy(&old, buf, sizeof(old));
+        strncpy(join->name, old.name, MAXNAME - 1);
+        strncpy(join->to_client_fname, old.to_client_fname, MAXPATH - 1);
+        strncpy(join->to_server_fname, old.to_server_fname, MAXPATH - 1);
+        join->version = 1;
+        return join->name[0] == '\0' ? -1 : 0;
+    }
+    join->version = hdr.version;
+    join->caps = hdr.caps;
+    join->last_seq = hdr.last_seq;
+    char *names[3] = {join->name, join->to_client_fname, join->to_server_fname};
+    int max[3] = {MAXNAME, MAXPATH, MAXPATH};
+    buf += sizeof(hdr);
+    int off = 0;
+    for (int i = 0; i < 3; ++i) {
+        int len = strnlen(buf + off, hdr.len - off);
+        if (off + len >= hdr.len || len >= max[i]) { // missing terminator or too long
+            return -1;
+        }
+        memcpy(names[i], buf + off, len + 1);
+        off += len + 1;
+    }
+    for (; join->n_filters < hdr.n_filters; join->n_filters++) {
+        int len = strnlen(buf + off, hdr.len - off);
+        if (join->n_filters == FILTER_LINES || off + len >= hdr.len || len >= MAXLINE) {
+            return -1;
+        }
+        memcpy(join->filters[join->n_filters], buf + off, len + 1);
+        off += len + 1;
+    }
+    return join->name[0] == '\0' ? -1 : 0;
+}
+
+// Returns the ENC_ encoding for messages to a client with the given
+// protocol version and granted caps. Clients without CAP_NAMEIDS get
+// the sender's name in every message.
+int client_encoding(int version, int caps) {
+    if (version < 2) {
+        return ENC_LEGACY;
+    }
+    if (!(caps & CAP_NAMEIDS)) {
+        return caps & CAP_COMPRESS ? ENC_NAMED_LZ : ENC_NAMED;
+    }
+    return caps & CAP_COMPRESS ? ENC_LZ : ENC_COMPACT;
+}
+
+// Encode mesg into buf, which must have room for FRAME_MAX bytes, in
+// the given ENC_ encoding; with_name is as for mesg_encode() except
+// that ENC_NAMED and ENC_NAMED_LZ always include the name and have no
+// BL_NAME, which binds ids to names. ENC_LZ and ENC_NAMED_LZ compress
+// bodies of COMPRESS_MIN bytes or more when that saves space. Returns
+// the number of bytes or 0 if the encoding has no form for the kind of
+// message, which is then not sent.
+int mesg_encode_for(mesg_t *mesg, int enc, int with_name, char *buf) {
+    if (enc == ENC_LEGACY) {
+        if (mesg->kind > BL_PING && mesg->kind != BL_CHUNK) { // kinds added after version 1
+            return 0;
+        }
+        mesg_v1_t old;
+        memset(&old, 0, sizeof(old));
+        old.kind = mesg->kind == BL_CHUNK ? BL_MESG : mesg->kind; // chunks show as plain messages
+        strcpy(old.name, mesg->name); // version 1 always carries names
+        strcpy(old.body, mesg->body);
+        memcpy(buf, &old, sizeof(old));
+        return sizeof(old);
+    }
+    if (enc == ENC_NAMED || enc == ENC_NAMED_LZ) {
+        if (mesg->kind == BL_NAME) {
+            return 0;
+        }
+        with_name = 1;
+    }
+    int len = mesg_encode(mesg, with_name, buf);
+    wire_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if ((enc == ENC_LZ || enc == ENC_NAMED_LZ) && hdr.body_len >= COMPRESS_MIN) {
+        char packed[MAXLINE];
+        char *body = buf + sizeof(hdr) + hdr.name_len;
+        int tail = len - (sizeof(hdr) + hdr.name_len + hdr.body_len); // trace stamps
+        int n_packed = lz_compress(body, hdr.body_len, packed, hdr.body_len - 1);
+        if (n_packed > 0) {             // only if it shrank
+            memcpy(body, packed, n_packed);
+            memmove(body + n_packed, body + hdr.body_len, tail);
+            hdr.flags |= WIRE_LZ;
+            hdr.body_len = n_packed;
+            memcpy(buf, &hdr, sizeof(hdr));
+            len = sizeof(hdr) + hdr.name_len + n_packed + tail;
+        }
+    }
+    return len;
+}
+
+// Point body at the body of the encoded message at the start of buf,
+// which must be whole and not compressed, and return its length. Used
+// for log records of streamed messages whose bodies are longer than
+// mesg_t holds.
+int frame_body(char *buf, char **body) {
+    wire_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    *body = buf + sizeof(hdr) + hdr.name_len;
+    return hdr.body_len;
+}
+
+// Fill to_client and to_server with the names of the FIFOs at index k
+// of the pool of the server called server_name.
+void pool_fifo_names(char *server_name, int k, char *to_client, char *to_server) {
+    sprintf(to_client, "%s.pool.%d.client.fifo", server_name, k);
+    sprintf(to_server, "%s.pool.%d.server.fifo", server_name, k);
+}
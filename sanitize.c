@@ -0,0 +1,156 @@
+// Cleaning of text from clients before it reaches other clients'
+// terminals and the log: control bytes, which could move the cursor
+// or restyle the terminal through escape sequences, are shown in caret
+// form and bytes which are not valid UTF-8 become '?'. Newlines and
+// tabs are kept. Most chat is plain printable ASCII, which is skipped
+// 16 bytes at a time with SSE2 where the compiler targets it.
+
+#include "blather.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Returns the number of printable ASCII bytes, 0x20 to 0x7E, at the
+// start of the len bytes of text, one byte at a time.
+int text_ascii_prefix_scalar(const char *text, int len) {
+    int i = 0;
+    while (i < len && text[i] >= 0x20 && text[i] < 0x7F) { // char is signed: bytes over 0x7F are negative
+        i++;
+    }
+    return i;
+}
+
+// As text_ascii_prefix_scalar() but testing 16 bytes at once when
+// SSE2 is available.
+int text_ascii_prefix(const char *text, int len) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (text + i));
+        // signed compare: bytes over 0x7F are negative so below space too
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+        int mask = _mm_movemask_epi8(bad);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + text_ascii_prefix_scalar(text + i, len - i);
+#else
+    return text_ascii_prefix_scalar(text, len);
+#endif
+}
+
+// Returns the length of the valid UTF-8 sequence for a character of
+// U+00A0 or above starting the len bytes at s, or 0 if there is none.
+// Overlong forms, surrogates, values past U+10FFFF and the C1 controls
+// U+0080 to U+009F, which some terminals obey, are all refused.
+int utf8_seq_len(const uint8_t *s, int len) {
+    uint8_t lo = 0x80, hi = 0xBF;       // range of the second byte
+    int n;
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        n = 2;
+        if (s[0] == 0xC2) {
+            lo = 0xA0;
+        }
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        n = 3;
+        if (s[0] == 0xE0) {
+            lo = 0xA0;
+        } else if (s[0] == 0xED) {
+            hi = 0x9F;
+        }
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        n = 4;
+        if (s[0] == 0xF0) {
+            lo = 0x90;
+        } else if (s[0] == 0xF4) {
+            hi = 0x8F;
+        }
+    } else {
+        return 0;
+    }
+    if (n > len || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+    for (int k = 2; k < n; ++k) {
+        if ((s[k] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// Clean the string text, which is in a buffer of max bytes, in place:
+// control bytes other than newline and tab become caret pairs like ^[,
+// or '?' if keep_len is set so the length does not change, and bytes
+// not part of valid UTF-8 become '?'. Text which grows past max-1
+// bytes is cut. Returns the number of bytes changed, 0 when the text
+// was already clean and was left as it is.
+int text_sanitize(char *text, int max, int keep_len) {
+    int len = strlen(text);
+    int i = text_ascii_prefix(text, len);
+    if (i == len) { // the common case
+        return 0;
+    }
+    char out[MAXLINE];
+    max = max < sizeof(out) ? max : sizeof(out);
+    memcpy(out, text, i);
+    int o = i, fixed = 0;
+    while (i < len) {
+        uint8_t c = text[i];
+        int n = 1;
+        if ((c >= 0x20 && c < 0x7F) || c == '\n' || c == '\t') {
+            n = 1 + text_ascii_prefix_scalar(text + i + 1, len - i - 1 < 15 ? len - i - 1 : 15);
+            if (n == 16) { // a long run, worth the vector scan
+                n += text_ascii_prefix(text + i + 16, len - i - 16);
+            }
+            if (o + n > max - 1) {
+                break;
+            }
+            memcpy(out + o, text + i, n);
+        } else if ((c < 0x20 || c == 0x7F) && keep_len) {
+            out[o] = '?';
+            fixed++;
+        } else if (c < 0x20 || c == 0x7F) {
+            if (o + 2 > max - 1) {
+                break;
+            }
+            out[o] = '^';
+            out[o + 1] = c ^ 0x40;      // ESC shows as ^[, DEL as ^?
+            o++;
+            fixed++;
+        } else if ((n = utf8_seq_len((uint8_t *) text + i, len - i)) > 0) {
+            if (o + n > max - 1) {
+                break;
+            }
+            memcpy(out + o, text + i, n);
+        } else {
+            n = 1;
+            out[o] = '?';
+            fixed++;
+        }
+        o += n;
+        i += n;
+    }
+    fixed += len - i;                   // cut off
+    out[o] = '\0';
+    memcpy(text, out, o + 1);
+    return fixed;
+}
+
+// Returns len less any bytes at the end of text which start a UTF-8
+// sequence without finishing it, so text cut there does not split a
+// character.
+int utf8_whole_prefix(const char *text, int len) {
+    for (int back = 1; back <= 3 && back <= len; ++back) {
+        uint8_t c = text[len - back];
+        if ((c & 0xC0) == 0x80) { // continuation byte, keep looking for the lead
+            continue;
+        }
+        int need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return need > back ? len - back : len;
+    }
+    return len;
+}
@@ -1,6 +1,7 @@
 // Implement the functions in this file to manipulate the server_t and client_t data that will ultimately
 // be used by the server to fulfill its role.
 
+#define _GNU_SOURCE             // splice(), tee() and F_GETPIPE_SZ
 # include "blather.h"
 
 extern int DO_ADVANCED;
@@ -31,6 +32,16 @@ void server_start(server_t *server, char *server_name, int perms) {
     log_printf("BEGIN: server_start()\n");
 
     strcpy(server->server_name, server_name);
+    server->start_ns = server_clock(server);
+    server->start_time_sec = time(NULL);
+    server->stall_min_ns = STALL_MSECS * (NANOS_PER_SEC / 1000);
+    char *upgrade_fd = getenv("BL_UPGRADE_FD");
+    if (upgrade_fd != NULL) { // started by server_upgrade(), take over from the old server
+        unsetenv("BL_UPGRADE_FD");
+        server_resume(server, atoi(upgrade_fd));
+        log_printf("END: server_start()\n");
+        return;
+    }
     char fifo_name[MAXNAME + 5];
     strcpy(fifo_name, server_name);
     strcat(fifo_name, ".fifo"); // the full file name
@@ -40,27 +51,70 @@ void server_start(server_t *server, char *server_name, int perms) {
     server->join_fd = open(fifo_name, O_RDWR); // open the FIFO and stores its file descriptor in join_fd
     check_fail(server->join_fd == -1, 1, "open fifo file %s fail.\n", fifo_name);
 
+    char admin_name[MAXPATH + 16];
+    snprintf(admin_name, sizeof(admin_name), "%s.admin.fifo", server_name);
+    remove(admin_name);
+    mkfifo(admin_name, perms);
+    server->admin_fd = open(admin_name, O_RDWR); // kept open for writing too so it never reads end of file
+    check_fail(server->admin_fd == -1, 1, "open fifo file %s fail.\n", admin_name);
+    server->ping_interval = ALARM_INTERVAL;
+    server->disconnect_secs = DISCONNECT_SECS;
+    server->pipe_max = pipe_max_size();
+    server_pool_start(server);
+
     if(DO_ADVANCED) {
+        server_open_log(server);
+    }
+
+    dbg_printf("server_start: %s\n", server->server_name);
+    log_printf("END: server_start()\n");
+}
+
+// ADVANCED: Open the log, server_name.log, and its semaphore, writing
+// an empty who_t to a new log, and load the history kept in it. Called
+// at the start and when advanced mode is turned on by an admin.
+void server_open_log(server_t *server) {
+    {
+        char *server_name = server->server_name;
         char log_name[MAXNAME + 5];
         strcpy(log_name, server_name);
         strcat(log_name, ".log");
         // remove(log_name); // remove any existing file of that name
         server->log_fd = open(log_name, O_RDWR | O_CREAT);
         check_fail(server->log_fd == -1, 1, "open log file %s fail.\n", log_name);
-        server->start_time_sec = time(NULL);
         char sem_name[MAXNAME + 5];
         strcpy(sem_name, server_name);
         strcat(sem_name, ".sem");
         server->log_sem = sem_open(sem_name, O_RDWR | O_CREAT, 0644, 1);
+        if (lseek(server->log_fd, 0, SEEK_END) < sizeof(who_t)) { // new log starts with an empty who_t
+            who_t who;
+            memset(&who, 0, sizeof(who_t));
+            pwrite(server->log_fd, &who, sizeof(who_t), 0);
+        }
+        static name_table_t names;
+        long offset = server_load_snapshot(server, &names); // skip what the snapshot has
+        server_load_history(server, offset, &names); // continue sequence numbers from a previous run
+        server->snap_time = server->time_sec;
     }
+}
 
-    dbg_printf("server_start: %s\n", server->server_name);
-    log_printf("END: server_start()\n");
+// ADVANCED: Close the log and close and unlink its semaphore.
+void server_close_log(server_t *server) {
+    close(server->log_fd);
+    sem_close(server->log_sem);
+    char sem_name[MAXNAME + 5];
+    strcpy(sem_name, server->server_name);
+    strcat(sem_name, ".sem");
+    check_fail(sem_unlink(sem_name) == -1, 1, "unlink sem %s error.", sem_name);
+    remove(sem_name);
 }
 
 // Shut down the server. Close the join FIFO and unlink (remove) it so
 // that no further clients can join. Send a BL_SHUTDOWN message to all
-// clients and proceed to remove all clients in any order.
+// clients and proceed to remove all clients in any order. Queued
+// output is written for at most DRAIN_SECS, or until a second signal,
+// so a client which stopped reading cannot hold up the shutdown; what
+// is left is dropped and counted in a log message.
 //
 // ADVANCED: Close the log file. Close the log semaphore and unlink
 // it.
@@ -71,28 +125,69 @@ void server_start(server_t *server, char *server_name, int perms) {
 void server_shutdown(server_t *server) {
     log_printf("BEGIN: server_shutdown()\n");
     close(server->join_fd); // close the join FIFO
-    // char *fifo_name = strcat(server->server_name, ".fifo");
-    // remove(fifo_name); // remove FIFO
+    char fifo_name[MAXPATH + 8];
+    snprintf(fifo_name, sizeof(fifo_name), "%s.fifo", server->server_name);
+    remove(fifo_name); // remove FIFO
+
+    if (server->stopping == 0) {
+        server->stopping = 1;
+    }
+    server->drain_end = clock_ns() + DRAIN_SECS * NANOS_PER_SEC;
 
+    for (int i = 0; i < server->n_clients; ++i) { // attachments under way are finished with zeros
+        if (server_get_client(server, i)->attach_left > 0) {
+            server_relay_end(server, i);
+        }
+    }
     mesg_t mesg;
     memset(&mesg, 0, sizeof(mesg_t));
     mesg.kind = BL_SHUTDOWN;
     server_broadcast(server, &mesg);
+    while (1) { // deliver anything still queued until the deadline
+        struct pollfd pfds[MAXCLIENTS];
+        int n_pending = 0;
+        for (int i = 0; i < server->n_clients; ++i) {
+            pfds[i].fd = server_client_pending(server, i) ? server->client[i].to_client_fd : -1;
+            pfds[i].events = POLLOUT;
+            n_pending += pfds[i].fd != -1;
+        }
+        if (n_pending == 0 || server_poll(server, pfds, server->n_clients, -1) <= 0) {
+            break;
+        }
+        for (int i = 0; i < server->n_clients; ++i) {
+            if (pfds[i].revents & (POLLOUT | POLLERR)) {
+                server_flush_client(server, i, 0);
+            }
+        }
+    }
 
+    int n_lost = 0, n_stuck = 0, n_clients = server->n_clients;
     for (int i = 0; i < server->n_clients; ++i) {
-        server_remove_client(server, i);
+        client_t *client = server_get_client(server, i);
+        if (server_client_pending(server, i)) {
+            dbg_printf("server_shutdown: client %d '%s' did not read %d messages\n", i, client->name,
+                       client->ctl_lane.count + client->data_lane.count);
+            n_lost += client->ctl_lane.count + client->data_lane.count;
+            n_stuck++;
+        }
+    }
+    while (server->n_clients > 0) { // from the end, nothing shifts under the loop
+        server_remove_client(server, server->n_clients - 1);
+    }
+    server_pool_close(server);
+    if (n_stuck > 0) {
+        log_printf("shutdown: %d messages undelivered to %d of %d clients\n", n_lost, n_stuck, n_clients);
     }
 
     // TODO Advanced
-    close(server->join_fd);
+    close(server->admin_fd);
+    char admin_name[MAXPATH + 16];
+    snprintf(admin_name, sizeof(admin_name), "%s.admin.fifo", server->server_name);
+    remove(admin_name);
     if(DO_ADVANCED) {
-        close(server->log_fd);
-        sem_close(server->log_sem);
-        char sem_name[MAXNAME + 5];
-        strcpy(sem_name, server->server_name);
-        strcat(sem_name, ".sem");
-        check_fail(sem_unlink(sem_name) == -1, 1, "unlink sem %s error.", sem_name);
-        remove(sem_name);
+        server_snapshot(server, 1); // so the next start need not read the log
+        fsync(server->log_fd);
+        server_close_log(server);
     }
 
     dbg_printf("server_shutdown: %s\n", server->server_name);
@@ -102,7 +197,15 @@ void server_shutdown(server_t *server) {
 // Adds a client to the server according to the parameter join which
 // should have fields such as name filed in.  The client data is
 // copied into the client[] array and file descriptors are opened for
-// its to-server and to-client FIFOs. Initializes the data_ready field
+// its to-server and to-client FIFOs, which must be present. The
+// protocol version is the lower of the client's and the server's and
+// the features used are those in both the client's and SERVER_CAPS;
+// these pick the encoding of everything sent to the client. The
+// client is sent BL_ACCEPT with the granted caps. Filters sent with
+// the join are set up before anything is sent which they apply to. The client gets the lowest free
+// id which is announced with its name in the JOINED broadcast; the
+// new client is sent a NAME message for each client already present
+// so it can resolve their ids. Initializes the data_ready field
 // for the client to 0. Returns 0 on success and non-zero if the
 // server as no space for clients (n_clients == MAXCLIENTS).
 //
@@ -122,22 +225,70 @@ int server_add_client(server_t *server, join_t *join) {
     strcpy(client.name, join->name);
     strcpy(client.to_client_fname, join->to_client_fname);
     strcpy(client.to_server_fname, join->to_server_fname);
-    client.last_contact_time = time(NULL) - server->start_time_sec; // time since server start
+    client.last_contact_ns = server->now_ns;
+    client.stats.joined_ns = server->now_ns;
+
+    client.pool_slot = server_pool_claim(server, &client);
+    if (client.pool_slot == -1) { // the client made its own
+        client.to_client_fd = open(client.to_client_fname, O_RDWR | O_NONBLOCK); // writes are queued, see server_flush_client()
+        client.to_server_fd = open(client.to_server_fname, O_RDWR);
+    }
+    if (client.to_client_fd == -1 || client.to_server_fd == -1) { // bad paths from the client
+        dbg_printf("server_add_client: cannot open fifos of %s\n", join->name);
+        close(client.to_client_fd);
+        close(client.to_server_fd);
+        log_printf("END: server_add_client()\n");
+        return -1;
+    }
 
-    client.to_client_fd = open(client.to_client_fname, O_RDWR);
-    check_fail(client.to_client_fd == -1, 1, "open fifo file %s\n error", join->to_client_fname);
-    client.to_server_fd = open(client.to_server_fname, O_RDWR);
-    check_fail(client.to_server_fd == -1, 1, "open fifo file %s\n error", join->to_server_fname);
+    server_pipe_sizes(server, &client);
+    client.out_peak = client.in_peak = 0;
+
+    for (client.id = 1; server->id_used[client.id]; ++client.id); // lowest free id, one exists while n_clients < MAXCLIENTS
+    server->id_used[client.id] = 1;
+    client.version = join->version < PROTO_VERSION ? join->version : PROTO_VERSION; // agree on the lower version
+    client.caps = join->caps & SERVER_CAPS;
+    client.enc = client_encoding(client.version, client.caps);
+    client.filter.kinds = FILTER_ALL;
 
     // fill the message struct
     mesg_t join_mesg;
     memset(&join_mesg, 0, sizeof(mesg_t));
     join_mesg.kind = BL_JOINED;
+    join_mesg.sender = client.id;         // announces the id with the name
     strcpy(join_mesg.name, client.name); // the name of client
     // sprintf(join_mesg.body, "%s join the server %s.", join->name, server->server_name);
 
     // add the client info to the server
     server->client[server->n_clients++] = client;
+    PROBE3(client_add, client.id, client.name, server->n_clients);
+    mesg_t accept_mesg;
+    memset(&accept_mesg, 0, sizeof(mesg_t));
+    accept_mesg.kind = BL_ACCEPT;
+    accept_mesg.sender = client.id;
+    accept_mesg.seq = client.caps;
+    snprintf(accept_mesg.body, MAXLINE, "%d", server->disconnect_secs);
+    server_send_client(server, server->n_clients - 1, &accept_mesg);
+    for (int f = 0; f < join->n_filters && (client.caps & CAP_FILTERS); ++f) { // ahead of the replay
+        server_set_filter(server, server->n_clients - 1, join->filters[f]);
+    }
+    for (int i = 0; i < server->n_clients - 1; ++i) { // tell the new client who the others are
+        mesg_t name_mesg;
+        memset(&name_mesg, 0, sizeof(mesg_t));
+        name_mesg.kind = BL_NAME;
+        name_mesg.sender = server->client[i].id;
+        strcpy(name_mesg.name, server->client[i].name);
+        server_send_client(server, server->n_clients - 1, &name_mesg);
+        filter_t *filter = &server->client[i].filter;
+        for (int m = 0; m < MUTE_MAX; ++m) { // muted by name before joining
+            if (strcmp(filter->mute_names[m], client.name) == 0) {
+                filter->muted[client.id / 8] |= 1 << client.id % 8;
+            }
+        }
+    }
+    if (join->last_seq > 0 && (client.caps & CAP_RESUME)) { // rejoining client gets what it missed ahead of its join
+        server_replay(server, server->n_clients - 1, join->last_seq);
+    }
     server_broadcast(server, &join_mesg);
 
     dbg_printf("server_add_client: add %s to %s\n", join->name, server->server_name);
@@ -156,11 +307,43 @@ int server_remove_client(server_t *server, int idx) {
     }
 
     client_t *client = server_get_client(server, idx); // get the client
-    if (close(client->to_client_fd) == -1 || close(client->to_server_fd) == -1) {
-        return -1;
+    if (client->attach_left > 0) { // its recipients get zeros for the rest
+        server_relay_end(server, idx);
+    }
+    for (int i = 0; i < server->n_clients; ++i) { // no longer a recipient of anyone's attachment
+        client_t *sender = server_get_client(server, i);
+        for (int j = 0; j < sender->attach_n; ++j) {
+            if (sender->attach_to[j] == client->id) {
+                close(sender->attach_pipe[j]);
+                sender->attach_n--;
+                sender->attach_to[j] = sender->attach_to[sender->attach_n];
+                sender->attach_pipe[j] = sender->attach_pipe[sender->attach_n];
+                sender->attach_ahead[j] = sender->attach_ahead[sender->attach_n];
+                break;
+            }
+        }
+    }
+    lane_t *lanes[2] = {&client->ctl_lane, &client->data_lane};
+    for (int l = 0; l < 2; ++l) { // drop output that will never be delivered
+        for (; lanes[l]->count > 0; lanes[l]->count--) {
+            frame_release(lanes[l]->frames[lanes[l]->head]);
+            lanes[l]->head = (lanes[l]->head + 1) % OUTQ_LEN;
+        }
+    }
+    if (client->pool_slot != -1) {
+        server_pool_release(server, client);
+    } else {
+        if (close(client->to_client_fd) == -1 || close(client->to_server_fd) == -1) {
+            return -1;
+        }
+        remove(client->to_client_fname);
+        remove(client->to_server_fname);
+    }
+    server->id_used[client->id] = 0;
+    PROBE3(client_remove, client->id, client->name, server->n_clients - 1);
+    for (int i = 0; i < server->n_clients; ++i) { // the id may go to someone else next
+        server_get_client(server, i)->filter.muted[client->id / 8] &= ~(1 << client->id % 8);
     }
-    remove(client->to_client_fname);
-    remove(client->to_server_fname);
 
     // shift the remaining clients to lower indices of the client[]
     for (int i = idx; i < server->n_clients - 1; ++i) {
@@ -172,30 +355,374 @@ int server_remove_client(server_t *server, int idx) {
 
 
 // Send the given message to all clients connected to the server by
-// writing it to the file descriptors associated with them.
+// stamping it with the next sequence number and keeping it in the
+// history for replay, if mesg_is_history() says it belongs there, and
+// queueing it for each of them whose filter
+// passes it. The message is encoded once per encoding in use into a
+// frame shared by all recipients using that encoding. Clients whose
+// filter drops a JOINED get a BL_NAME in its place so they can still
+// name the newcomer. Traced chat is stamped with the time it was
+// queued and sent with its stamps only to clients granted CAP_TRACE,
+// in frames of their own. SHUTDOWN, PING and DISCONNECTED go
+// to the control lane of each client so that they are never stuck
+// behind a backlog of chat; then as much as possible is written
+// without blocking and the remainder waits for server_flush_client().
 //
-// ADVANCED: Log the broadcast message unless it is a PING which
-// should not be written to the log.
+// ADVANCED: Log the broadcast message unless it is a PING or SHUTDOWN,
+// see mesg_is_history().
 void server_broadcast(server_t *server, mesg_t *mesg) {
     // send the given message to all clients connected to the server
     dbg_printf("server_broadcast() %d\n", server->n_clients);
+    long start_ns = clock_ns();
+    PROBE2(broadcast_start, mesg->kind, server->n_clients);
+    int n_sent = 0;
+    int traced = mesg->flags & WIRE_TRACE; // stamps go only to clients tracing, not history or the log
+    mesg->flags &= ~WIRE_TRACE;
+    if (traced) {
+        mesg->trace[TRACE_QUEUED] = clock_ns();
+        hist_add(&server->trace[TRACE_SERVER], mesg->trace[TRACE_QUEUED] - mesg->trace[TRACE_RECV]);
+    }
+    if (mesg_is_history(mesg->kind)) {
+        mesg->seq = ++server->last_seq;
+        server_history_add(server, mesg);
+    }
+    frame_t *frames[2][N_ENC][2] = {{{NULL}}}; // the message and its BL_NAME, with and without trace stamps, encoded on first use by a recipient
+    mesg_t name_mesg;
+    if (mesg->kind == BL_JOINED) {
+        name_mesg = *mesg;
+        name_mesg.kind = BL_NAME;
+    }
+    int ctl = mesg_is_control(mesg->kind);
     for (int i = 0; i < server->n_clients; ++i) {
-        long n_write = write(server_get_client(server, i)->to_client_fd, mesg, sizeof(mesg_t));
-        check_fail(n_write == -1, 1, "write to fd %d error.\n", server_get_client(server, i)->to_client_fd);
+        client_t *client = server_get_client(server, i);
+        int enc = client->enc, alt = 0;
+        if (!server_filter_pass(&client->filter, mesg)) {
+            if (mesg->kind != BL_JOINED) {
+                continue;
+            }
+            alt = 1;
+        }
+        int tr = traced && (client->caps & CAP_TRACE) ? 1 : 0;
+        if (frames[alt][enc][tr] == NULL) {
+            char buf[FRAME_MAX];
+            mesg->flags |= tr ? WIRE_TRACE : 0;
+            int len = mesg_encode_for(alt ? &name_mesg : mesg, enc, mesg->kind != BL_MESG, buf); // receivers know the ids of chat senders
+            mesg->flags &= ~WIRE_TRACE;
+            frames[alt][enc][tr] = frame_new(buf, len);
+            frames[alt][enc][tr]->refs++; // hold the frame while queueing
+            if (tr) {
+                frames[alt][enc][tr]->queued_ns = mesg->trace[TRACE_QUEUED];
+            }
+        }
+        if (frames[alt][enc][tr]->len > 0) {
+            server_enqueue(server, i, frames[alt][enc][tr], ctl);
+            server_flush_client(server, i, 0);
+            n_sent++;
+        }
+    }
+    for (int alt = 0; alt < 2; ++alt) {
+        for (int enc = 0; enc < N_ENC; ++enc) {
+            for (int tr = 0; tr < 2; ++tr) {
+                if (frames[alt][enc][tr] != NULL) {
+                    frame_release(frames[alt][enc][tr]);
+                }
+            }
+        }
     }
 
     // ADVANCED, write to binary log
     if(DO_ADVANCED) {
-        if (mesg->kind != BL_PING) {
+        if (mesg_is_history(mesg->kind) && mesg->kind != BL_CHUNK) { // chunks are logged by server_stream_chunk()
             server_log_message(server, mesg);
         }
     }
     dbg_printf("server_broadcast: %s\n", mesg->body);
+    PROBE3(broadcast_done, mesg->kind, mesg->seq, n_sent);
+    server_watch(server, WATCH_BROADCAST, -1, -1, start_ns);
+}
+
+// Queue the given message for the client at idx only, including the
+// sender's name, and write what fits.
+void server_send_client(server_t *server, int idx, mesg_t *mesg) {
+    char buf[FRAME_MAX];
+    int len = mesg_encode_for(mesg, server_get_client(server, idx)->enc, 1, buf);
+    if (len == 0) { // nothing the client would understand
+        return;
+    }
+    server_enqueue(server, idx, frame_new(buf, len), mesg_is_control(mesg->kind));
+    server_flush_client(server, idx, 0);
+}
+
+// Refuse the given join request by writing BL_REJECT with the reason
+// to the requesting client's to-client FIFO if it can be opened.
+// Version 1 clients have no reply to read and are just ignored.
+void server_reject_join(server_t *server, join_t *join, char *reason) {
+    dbg_printf("server_reject_join: %s: %s\n", join->name, reason);
+    if (join->version < 2) {
+        return;
+    }
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg_t));
+    mesg.kind = BL_REJECT;
+    strncpy(mesg.body, reason, MAXLINE - 1);
+    int fd = open(join->to_client_fname, O_WRONLY | O_NONBLOCK);
+    if (fd != -1) {
+        mesg_write(fd, &mesg);
+        close(fd);
+    }
+}
+
+// Allocate a frame holding a copy of the len bytes at data. The frame
+// starts with no references; each lane it is queued on adds one.
+frame_t *frame_new(void *data, int len) {
+    frame_t *frame = malloc(sizeof(frame_t) + len);
+    check_fail(frame == NULL, 1, "malloc frame error.\n");
+    frame->refs = 0;
+    frame->len = len;
+    frame->queued_ns = 0;
+    frame->attach_fd = -1;
+    frame->attach_eof = 0;
+    frame->attach_len = 0;
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+// Drop one reference to the frame, freeing it when none remain along
+// with the pipe of a BL_ATTACH frame.
+void frame_release(frame_t *frame) {
+    if (--frame->refs <= 0) {
+        if (frame->attach_fd != -1) {
+            close(frame->attach_fd);
+        }
+        free(frame);
+    }
+}
+
+// Returns 1 for kinds which travel on the control lane: liveness and
+// shutdown notices which must not wait behind queued chat.
+int mesg_is_control(mesg_kind_t kind) {
+    return kind == BL_SHUTDOWN || kind == BL_PING || kind == BL_DISCONNECTED;
+}
+
+// Returns 1 for kinds which are part of the conversation: numbered,
+// kept in the history for replay and logged. PING and SHUTDOWN are
+// about the connection a client has now and mean nothing to one
+// catching up later. DISCONNECTED, although it is sent ahead of chat,
+// tells of someone leaving as DEPARTED does and is kept.
+int mesg_is_history(mesg_kind_t kind) {
+    return kind != BL_SHUTDOWN && kind != BL_PING;
+}
+
+// Queue the frame for the client at idx on its control lane if ctl is
+// non-zero or its data lane otherwise. A full lane means the client
+// has not read anything for OUTQ_LEN messages; waiting for it would
+// hold up every other client, so unless writing what fits makes room
+// the frame is dropped and the client marked stuck, to be disconnected
+// by server_drop_stuck() once the work at hand is done. Returns 0 on
+// success and 1 if the frame was dropped.
+int server_enqueue(server_t *server, int idx, frame_t *frame, int ctl) {
+    client_t *client = server_get_client(server, idx);
+    lane_t *lane = ctl ? &client->ctl_lane : &client->data_lane;
+    if (lane->count == OUTQ_LEN) {
+        server_flush_client(server, idx, 0);
+    }
+    if (lane->count == OUTQ_LEN || client->stuck) { // nothing more once anything was lost
+        dbg_printf("client %d '%s' lane full, dropping\n", idx, client->name);
+        client->stuck = 1;
+        if (frame->refs == 0) {
+            frame_release(frame);
+        }
+        return 1;
+    }
+    lane->frames[(lane->head + lane->count) % OUTQ_LEN] = frame;
+    lane->count++;
+    frame->refs++;
+    if (client->ctl_lane.count + client->data_lane.count > client->stats.queue_peak) {
+        client->stats.queue_peak = client->ctl_lane.count + client->data_lane.count;
+    }
+    return 0;
+}
+
+// Returns the frame at the head of the client's data lane if the file
+// following it is being written and the sender has yet to provide
+// more of it, NULL otherwise.
+static frame_t *file_waiting(client_t *client) {
+    lane_t *lane = &client->data_lane;
+    if (lane->count == 0) {
+        return NULL;
+    }
+    frame_t *frame = lane->frames[lane->head];
+    if (frame->attach_fd == -1 || frame->attach_eof || lane->off < frame->len) {
+        return NULL;
+    }
+    int queued = 0;
+    ioctl(frame->attach_fd, FIONREAD, &queued);
+    return queued == 0 ? frame : NULL;
+}
+
+// Write up to n bytes of the file following the BL_ATTACH frame to fd
+// without blocking: spliced from the frame's pipe while the sender
+// keeps it open, zeros once it has gone. Returns as write().
+static long flush_file(int fd, frame_t *frame, long n) {
+    static char zeros[4096];
+    if (!frame->attach_eof) {
+        long n_splice = splice(frame->attach_fd, NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n_splice != 0) {
+            return n_splice;
+        }
+        frame->attach_eof = 1; // no writer left, see server_relay_end()
+    }
+    return write(fd, zeros, n < sizeof(zeros) ? n : sizeof(zeros));
+}
+
+// Write queued frames to the client at idx until its FIFO is full or
+// nothing is left. Control frames always go first except when a data
+// frame has been partially written and must be finished to keep the
+// stream intact; a BL_ATTACH frame is finished only once its file has
+// followed it, see server_relay_attachment(). Unless deadline_ns is 0,
+// wait for the client to read until everything is written, giving up
+// at deadline_ns by clock_ns() unless it is -1, or when the server is
+// told to shut down. A file waiting on its sender is never waited for.
+// Returns 1 if output is still pending and 0 otherwise.
+static int flush_lanes(server_t *server, int idx, long deadline_ns) {
+    client_t *client = server_get_client(server, idx);
+    client->write_ready = 0;
+    while (client->ctl_lane.count > 0 || client->data_lane.count > 0) {
+        lane_t *lane = &client->ctl_lane;
+        if (lane->count == 0 || client->data_lane.off > 0) {
+            lane = &client->data_lane;
+        }
+        frame_t *frame = lane->frames[lane->head];
+        long n_write;
+        if (lane->off < frame->len) {
+            n_write = write(client->to_client_fd, frame->data + lane->off, frame->len - lane->off);
+        } else {
+            n_write = flush_file(client->to_client_fd, frame, frame->len + frame->attach_len - lane->off);
+            if (n_write > 0) { // taking the file is all the client can do meanwhile
+                client->last_contact_ns = server->now_ns;
+            } else if (n_write == -1 && errno == EAGAIN && file_waiting(client) != NULL) {
+                return 1;
+            }
+        }
+        if (n_write == -1 && errno == EAGAIN) {
+            int backlog = client->out_pipe - (lane->off < frame->len ? lane->off : frame->len);
+            for (int l = 0; l < 2; ++l) { // the FIFO is full, plus what waits behind it
+                lane_t *q = l ? &client->data_lane : &client->ctl_lane;
+                for (int k = 0; k < q->count; ++k) {
+                    backlog += q->frames[(q->head + k) % OUTQ_LEN]->len;
+                }
+            }
+            if (backlog > client->out_peak) {
+                client->out_peak = backlog;
+            }
+            int wait_ms = -1;
+            if (deadline_ns != -1) {
+                wait_ms = (deadline_ns - clock_ns()) / 1000000;
+                if (wait_ms <= 0) {
+                    return 1;
+                }
+            }
+            struct pollfd pfd = {.fd = client->to_client_fd, .events = POLLOUT};
+            if (server_poll(server, &pfd, 1, wait_ms) <= 0 && server->stopping) {
+                return 1;
+            }
+            continue;
+        }
+        if (n_write == -1 && errno == EINTR) {
+            continue;
+        }
+        check_fail(n_write == -1, 1, "write to fd %d error.\n", client->to_client_fd);
+        lane->off += n_write;
+        if (lane->off == frame->len + frame->attach_len) { // frame complete, move to next
+            client->stats.mesgs_out++; // only now, frames dropped with the client never count
+            client->stats.bytes_out += lane->off;
+            if (frame->queued_ns != 0) {
+                hist_add(&server->trace[TRACE_WRITE], clock_ns() - frame->queued_ns);
+            }
+            frame_release(frame);
+            lane->head = (lane->head + 1) % OUTQ_LEN;
+            lane->count--;
+            lane->off = 0;
+        }
+    }
+    return 0;
+}
+
+// Write queued frames to the client at idx, timed by the watchdog, as
+// flush_lanes().
+int server_flush_until(server_t *server, int idx, long deadline_ns) {
+    long start_ns = clock_ns();
+    int pending = flush_lanes(server, idx, deadline_ns);
+    server_watch(server, WATCH_FLUSH, idx, server_get_client(server, idx)->to_client_fd, start_ns);
+    return pending;
+}
+
+// Write queued frames to the client at idx without waiting, or if block
+// is non-zero waiting as long as it takes, as flush_lanes().
+int server_flush_client(server_t *server, int idx, int block) {
+    return server_flush_until(server, idx, block ? -1 : 0);
+}
+
+// poll() the n pfds with the signals the server handles unblocked, so
+// they interrupt only waits and never the work between them. Once the
+// server is told to stop, waits end at the shutdown deadline, and at
+// once before shutdown has set one so the main loop can start it.
+int server_poll(server_t *server, struct pollfd *pfds, int n, int timeout_ms) {
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+        tsp = &ts;
+    }
+    if (server->stopping) {
+        if (server->stopping > 1 || server->drain_end == 0) { // asked again, or not draining yet
+            return -1;
+        }
+        long left_ms = (server->drain_end - clock_ns()) / 1000000; // the wait itself moves time on
+        if (left_ms <= 0) {
+            return 0;
+        }
+        if (tsp == NULL || timeout_ms > left_ms) {
+            ts.tv_sec = left_ms / 1000;
+            ts.tv_nsec = left_ms % 1000 * 1000000L;
+            tsp = &ts;
+        }
+    }
+    return ppoll(pfds, n, tsp, &server->poll_mask);
+}
+
+// Returns 1 if the client at idx has queued output not yet written.
+int server_client_pending(server_t *server, int idx) {
+    client_t *client = server_get_client(server, idx);
+    return client->ctl_lane.count > 0 || client->data_lane.count > 0;
+}
+
+// Returns 1 if the attachment the client at idx is sending can take
+// more input: some recipient which has had all taken so far has an
+// empty pipe, or there is no recipient left. See server_relay_input().
+static int relay_wants_input(client_t *client) {
+    if (client->attach_n == 0) {
+        return 1;
+    }
+    for (int j = 0; j < client->attach_n; ++j) {
+        int queued = 0;
+        ioctl(client->attach_pipe[j], FIONREAD, &queued);
+        if (client->attach_ahead[j] == 0 && queued == 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 // Checks all sources of data for the server to determine if any are
 // ready for reading. Sets the servers join_ready flag and the
 // data_ready flags of each of client if data is ready for them.
+// Clients with queued output are also polled for writing and have
+// their write_ready flag set once their FIFO has room, or once the
+// sender of an attachment being written to them provides more of it.
+// Neither the sender of an attachment nor its recipients are read
+// while one waits on the other, so their last_contact_ns is kept
+// current meanwhile.
 // Makes use of the poll() system call to efficiently determine which
 // sources are ready.
 //
@@ -214,34 +741,70 @@ void server_broadcast(server_t *server, mesg_t *mesg) {
 void server_check_sources(server_t *server) {
     log_printf("BEGIN: server_check_sources()\n");
 
-    struct pollfd poll_fds[1 + MAXCLIENTS];
+    struct pollfd poll_fds[2 + 2 * MAXCLIENTS];
     memset(poll_fds, 0, sizeof(poll_fds));
-    for (int i = 0; i < 1 + MAXCLIENTS; ++i) {
+    for (int i = 0; i < 2 + 2 * MAXCLIENTS; ++i) {
         poll_fds[i].fd = -1;
     }
     poll_fds[0].fd = server->join_fd;
     poll_fds[0].events |= POLLIN;
     
+    int backlog = server_output_backlog(server);
     for (int i = 0; i < server->n_clients; ++i) {
-        poll_fds[i + 1].fd = server->client[i].to_server_fd;
-        poll_fds[i + 1].events |= POLLIN;
+        client_t *client = server_get_client(server, i);
+        poll_fds[i + 1].fd = client->to_server_fd;
+        if (client->attach_left > 0) { // an attachment waits for its slowest recipient
+            if (relay_wants_input(client)) {
+                poll_fds[i + 1].events |= POLLIN;
+            } else {
+                client->last_contact_ns = server->now_ns;
+            }
+        } else if (!(backlog && client->streaming)) { // streams wait for receivers to catch up
+            poll_fds[i + 1].events |= POLLIN;
+        }
+    }
+
+    int admin = 1 + server->n_clients; // the admin FIFO next, not counted in the log
+    poll_fds[admin].fd = server->admin_fd;
+    poll_fds[admin].events = POLLIN;
+
+    // then the to-client FIFOs of clients with queued output, to wake
+    // when it can be written, or the pipe of an attachment waiting on
+    // its sender
+    int n_fds = admin + 1, out_fd[MAXCLIENTS];
+    for (int i = 0; i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, i);
+        out_fd[i] = -1;
+        if (server_client_pending(server, i)) {
+            frame_t *file = file_waiting(client);
+            out_fd[i] = n_fds;
+            poll_fds[n_fds].fd = file != NULL ? file->attach_fd : client->to_client_fd;
+            poll_fds[n_fds++].events = file != NULL ? POLLIN : POLLOUT;
+            if (file != NULL) {
+                client->last_contact_ns = server->now_ns;
+            }
+        }
     }
 
     log_printf("poll()'ing to check %d input sources\n", 1 + server->n_clients);
-    int num = poll(poll_fds, 1 + server->n_clients, -1);
+    int num = server_poll(server, poll_fds, n_fds, server->join_have > 0 ? 0 : -1); // no waiting with joins read ahead
     log_printf("poll() completed with return value %d\n", num);
     if (num == -1) {
         log_printf("poll() interrupted by a signal\n");
+        log_printf("END: server_check_sources()\n");
+        return;
     }
 
     // check the join_fd
-    if (POLLIN & poll_fds[0].revents) {
+    if ((POLLIN & poll_fds[0].revents) || server->join_have > 0) {
         log_printf("join_ready = %d\n", 1);
         server->join_ready = 1;
     } else {
         log_printf("join_ready = %d\n", 0);
     }
 
+    server->admin_ready = (poll_fds[admin].revents & POLLIN) != 0;
+
     // check all the clients fd
     for (int i = 0; i < server->n_clients; i++) {
         if (POLLIN & poll_fds[i + 1].revents) {
@@ -250,6 +813,9 @@ void server_check_sources(server_t *server) {
         } else {
             log_printf("client %d '%s' data_ready = %d\n", i, server_get_client(server, i)->name, 0);
         }
+        if (out_fd[i] != -1 && poll_fds[out_fd[i]].revents != 0) { // POLLHUP once the sender has gone
+            server_get_client(server, i)->write_ready = 1;
+        }
     }
 
     log_printf("END: server_check_sources()\n");
@@ -261,8 +827,54 @@ int server_join_ready(server_t *server) {
     return server->join_ready;
 }
 
+// Read from the join FIFO into join_buf until it holds want bytes or
+// nothing more is queued, never waiting. Returns 1 if want bytes are
+// held.
+static int join_fill(server_t *server, int want) {
+    int avail = 0;
+    ioctl(server->join_fd, FIONREAD, &avail);
+    if (want > server->join_have && avail > 0) {
+        int n_read = read(server->join_fd, server->join_buf + server->join_have,
+                          want - server->join_have < avail ? want - server->join_have : avail);
+        if (n_read > 0) {
+            server->join_have += n_read;
+        }
+    }
+    return server->join_have >= want;
+}
+
+// Read the next join request into join, starting with any bytes left
+// in join_buf. Requests are written whole, so one which is not all
+// there is malformed rather than late. A malformed request is dropped
+// up to the next JOIN_MAGIC, keeping the requests queued behind it;
+// what was read past it stays in join_buf. Returns 0 on success and -1
+// if a malformed request was dropped.
+static int join_next(server_t *server, join_t *join) {
+    int size = -1;
+    if (join_fill(server, sizeof(join_hdr_t)) && (size = join_size(server->join_buf)) != -1 &&
+        join_fill(server, size) && join_decode(server->join_buf, size, join) == 0) {
+        server->join_have -= size;
+        memmove(server->join_buf, server->join_buf + size, server->join_have);
+        return 0;
+    }
+    join_fill(server, JOIN_BUF);
+    uint16_t magic = JOIN_MAGIC;
+    int skip = 1;
+    while (skip + sizeof(magic) <= server->join_have && memcmp(server->join_buf + skip, &magic, sizeof(magic)) != 0) {
+        skip++;
+    }
+    if (skip + sizeof(magic) > server->join_have) { // no request follows in what was read
+        skip = server->join_have;
+    }
+    server->join_have -= skip;
+    memmove(server->join_buf, server->join_buf + skip, server->join_have);
+    return -1;
+}
+
 // Call this function only if server_join_ready() returns true. Read a
-// join request and add the new client to the server. After finishing,
+// join request and add the new client to the server. Requests which
+// cannot be served get a BL_REJECT reply, see server_reject_join();
+// accepted clients get BL_ACCEPT from server_add_client(). After finishing,
 // set the servers join_ready flag to 0.
 //
 // LOG Messages:
@@ -271,13 +883,25 @@ int server_join_ready(server_t *server) {
 // log_printf("END: server_handle_join()\n");                 // at end of function
 void server_handle_join(server_t *server) {
     log_printf("BEGIN: server_handle_join()\n");
+    long start_ns = clock_ns();
+    PROBE1(join_start, server->n_clients);
     join_t join;
-    memset(&join, 0, sizeof(join_t));
-    long n_read = read(server->join_fd, &join, sizeof(join_t));
-    check_fail(n_read == -1, 1, "read fd %d error.\n", server->join_fd);
-    log_printf("join request for new client '%s'\n", join.name);
-    server_add_client(server, &join);
+    if (join_next(server, &join) == -1) {
+        dbg_printf("server_handle_join: malformed join request dropped\n");
+    } else {
+        text_sanitize(join.name, MAXNAME, 0); // shown to everyone
+        log_printf("join request for new client '%s'\n", join.name);
+        if (server->n_clients >= MAXCLIENTS) {
+            server_reject_join(server, &join, "server is full");
+        } else if (server_add_client(server, &join) != 0) {
+            server_reject_join(server, &join, "cannot open client FIFOs");
+        }
+        server->pool_joins++;
+        server_pool_adjust(server); // after the reply, the client is not kept waiting
+    }
     server->join_ready = 0;
+    PROBE1(join_done, server->n_clients);
+    server_watch(server, WATCH_JOIN, -1, server->join_fd, start_ns);
     log_printf("END: server_handle_join()\n");
 }
 
@@ -294,12 +918,12 @@ int server_client_ready(server_t *server, int idx) {
 // only be called if server_client_ready() returns true. Read a
 // message from to_server_fd and analyze the message kind. Departure
 // and Message types should be broadcast to all other clients.  Ping
-// responses should only change the last_contact_time below. Behavior
+// responses should only change the last_contact_ns below. Behavior
 // for other message types is not specified. Clear the client's
 // data_ready flag so it has value 0.
 //
-// ADVANCED: Update the last_contact_time of the client to the current
-// server time_sec.
+// ADVANCED: Update the last_contact_ns of the client to the current
+// server clock.
 //
 // LOG Messages:
 // log_printf("BEGIN: server_handle_client()\n");           // at beginning of function
@@ -307,13 +931,66 @@ int server_client_ready(server_t *server, int idx) {
 // log_printf("client %d '%s' MESSAGE '%s'\n")              // indicates client message
 // log_printf("END: server_handle_client()\n");             // at end of function
 void server_handle_client(server_t *server, int idx) {
+    if (server_get_client(server, idx)->attach_left > 0) { // the bytes are an attachment's, not frames
+        server_relay_input(server, idx);
+        return;
+    }
     log_printf("BEGIN: server_handle_client()\n");
+    long start_ns = clock_ns();
+    int fd = server_get_client(server, idx)->to_server_fd;
+    PROBE2(handle_start, idx, fd);
     mesg_t mesg;
+    char buf[FRAME_MAX];
+    long n_read;
     memset(&mesg, 0, sizeof(mesg_t));
-    long n_read = read(server_get_client(server, idx)->to_server_fd, &mesg, sizeof(mesg_t));
-    check_fail(n_read == -1, 1, "read fd %d error.\n", server_get_client(server, idx)->to_server_fd);
+    int n_waiting = 0;
+    ioctl(server_get_client(server, idx)->to_server_fd, FIONREAD, &n_waiting);
+    if (n_waiting > server_get_client(server, idx)->in_peak) {
+        server_get_client(server, idx)->in_peak = n_waiting;
+    }
+    if (server_get_client(server, idx)->enc == ENC_LEGACY) { // version 1 clients write raw mesg_v1_t
+        mesg_v1_t old;
+        n_read = read(server_get_client(server, idx)->to_server_fd, &old, sizeof(old));
+        check_fail(n_read == -1, 1, "read fd %d error.\n", server_get_client(server, idx)->to_server_fd);
+        server_get_client(server, idx)->stats.bytes_in += n_read;
+        mesg.kind = old.kind;
+        strncpy(mesg.body, old.body, MAXLINE - 1);
+    } else {
+        n_read = frame_read(server_get_client(server, idx)->to_server_fd, buf);
+        if (n_read <= 0) { // a malformed frame, nothing after it can be found; only this client suffers
+            log_printf("client %d '%s' protocol error, disconnected\n", idx, server_get_client(server, idx)->name);
+            server_disconnect_client(server, idx);
+            log_printf("END: server_handle_client()\n");
+            return;
+        }
+        server_get_client(server, idx)->stats.bytes_in += n_read;
+        mesg_decode(buf, n_read, &mesg, NULL);
+    }
+    if (mesg.kind == BL_MESG || mesg.kind == BL_CHUNK || mesg.kind == BL_ATTACH) {
+        // no terminal control from other clients; chunks keep their length for the stream's count
+        if (text_sanitize(mesg.body, MAXLINE, mesg.kind == BL_CHUNK) > 0) {
+            log_printf("client %d message sanitized\n", idx);
+        }
+    }
+    if (mesg.kind == BL_MESG || mesg.kind == BL_CHUNK) {
+        server_check_rules(server);
+        if (server->rules != NULL && matcher_mask(server->rules, mesg.body) > 0) {
+            log_printf("client %d message masked by rules\n", idx);
+        }
+    }
+    mesg.sender = server_get_client(server, idx)->id; // the FIFO tells who sent it
+    strcpy(mesg.name, server_get_client(server, idx)->name);
     server_get_client(server, idx)->data_ready = 0;
-    server_get_client(server, idx)->last_contact_time = time(NULL);
+    server_get_client(server, idx)->last_contact_ns = server->now_ns;
+    server_get_client(server, idx)->stats.mesgs_in++;
+    if (mesg.flags & WIRE_TRACE) { // stamped to the moment, not the loop's clock
+        if (mesg.kind == BL_MESG && (server_get_client(server, idx)->caps & CAP_TRACE)) {
+            mesg.trace[TRACE_RECV] = clock_ns();
+            hist_add(&server->trace[TRACE_TO_SERVER], mesg.trace[TRACE_RECV] - mesg.trace[TRACE_SENT]);
+        } else {
+            mesg.flags &= ~WIRE_TRACE;
+        }
+    }
 
     switch (mesg.kind) {
         case BL_DEPARTED:
@@ -325,37 +1002,93 @@ void server_handle_client(server_t *server, int idx) {
             log_printf("client %d '%s' MESSAGE '%s'\n", idx, mesg.name, mesg.body);
             server_broadcast(server, &mesg);
             break;
+        case BL_CHUNK:
+            server_stream_chunk(server, idx, &mesg);
+            break;
+        case BL_FILTER:
+            server_set_filter(server, idx, mesg.body);
+            break;
+        case BL_ATTACH:
+            log_printf("client %d '%s' ATTACH '%s' %d bytes\n", idx, mesg.name, mesg.body, mesg.seq);
+            server_relay_attachment(server, idx, &mesg);
+            break;
         case BL_DISCONNECTED: // TODO Advanced
             break;
-        case BL_PING:
-            server_get_client(server, idx)->last_contact_time = time(NULL) - server->start_time_sec; // since start time
+        case BL_PING: // contact is noted above for every kind
             break;
         case BL_SHUTDOWN: // do nothing here
             break;
+        default: // remaining kinds are only sent by the server
+            break;
     }
 
+    PROBE3(handle_done, idx, mesg.kind, n_read); // bytes taken off the FIFO, known already
+    server_watch(server, WATCH_CLIENT, mesg.kind == BL_DEPARTED ? -1 : idx, fd, start_ns); // idx is another client once one departs
     log_printf("END: server_handle_client()\n");
 }
 
 
-// TODO Advanced
+// Read the server clock, once per turn of the main loop, into now_ns
+// and time_sec and return it. Timeouts, rates and timings all compare
+// against this cached value rather than asking the kernel each time.
+long server_clock(server_t *server) {
+    server->now_ns = clock_ns();
+    server->time_sec = (server->now_ns - server->start_ns) / NANOS_PER_SEC;
+    return server->now_ns;
+}
+
+// Names of the WATCH_ kinds of work, for the log and stats.
+static char *watch_names[N_WATCH] = {
+    "loop", "handle_join", "handle_client", "broadcast", "flush_client", "log_message", "write_who", "handle_admin",
+};
+
+// Watchdog: note the end of the work of the given WATCH_ kind begun at
+// start_ns, by clock_ns(), for the client at idx using fd, either -1
+// if none. Work which took stall_min_ns or more held up every client;
+// it is logged and counted for its kind and client so that freezes can
+// be put down to a slow client or the disk.
+void server_watch(server_t *server, int what, int idx, int fd, long start_ns) {
+    long took = clock_ns() - start_ns;
+    if (took < server->stall_min_ns) {
+        return;
+    }
+    server->stalls[what]++;
+    server->stall_ns[what] += took;
+    char who[MAXPATH + 32] = "";
+    if (idx >= 0 && idx < server->n_clients) {
+        client_t *client = server_get_client(server, idx);
+        client->stalls++;
+        client->stall_ns += took;
+        snprintf(who, sizeof(who), " client %d '%s'", idx, client->name);
+    }
+    log_printf("stall: %s%s fd %d took %.3f ms\n", watch_names[what], who, fd, (double) took / 1000000);
+}
+
 // ADVANCED: Increment the time for the server
 void server_tick(server_t *server) {
-    server->time_sec = time(NULL) - server->start_time_sec;
+    server_clock(server);
 }
 
 // ADVANCED: Ping all clients in the server by broadcasting a ping.
 void server_ping_clients(server_t *server) {
+    for (int i = 0; i < server->n_clients; ++i) { // nothing heard since the last ping
+        client_t *client = server_get_client(server, i);
+        if (server->last_ping_ns > 0 && client->last_contact_ns < server->last_ping_ns) {
+            client->stats.pings_missed++;
+        }
+    }
+    server->last_ping_ns = server->now_ns;
     mesg_t mesg;
     memset(&mesg, 0, sizeof(mesg));
     mesg.kind = BL_PING;
+    snprintf(mesg.body, MAXLINE, "%d", server->disconnect_secs); // clients give up on the server as it does on them
     server_broadcast(server, &mesg);
-    server_remove_disconnected(server, 5);
+    server_remove_disconnected(server, server->disconnect_secs);
 }
 
 // ADVANCED: Check all clients to see if they have contacted the
-// server recently. Any client with a last_contact_time field equal to
-// or greater than the parameter disconnect_secs should be
+// server recently. Any client whose last_contact_ns is disconnect_secs
+// or more before the server clock should be
 // removed. Broadcast that the client was disconnected to remaining
 // clients.  Process clients from lowest to highest and take care of
 // loop indexing as clients may be removed during the loop
@@ -365,12 +1098,14 @@ void server_remove_disconnected(server_t *server, int disconnect_secs) {
     memset(&mesg, 0, sizeof(mesg));
     mesg.kind = BL_DISCONNECTED;
     char disconnected_name_list[MAXCLIENTS][MAXNAME]; // store the leave client names
+    int disconnected_id_list[MAXCLIENTS];
 
     dbg_printf("checking clients' connection.\n");
 
     int cnt = 0;
     for (int i = 0; i < server->n_clients; ++i) {
-        if (server->time_sec - server_get_client(server, i)->last_contact_time >= disconnect_secs) {
+        if (server->now_ns - server_get_client(server, i)->last_contact_ns >= disconnect_secs * NANOS_PER_SEC) {
+            disconnected_id_list[cnt] = server_get_client(server, i)->id;
             strcpy(disconnected_name_list[cnt++], server_get_client(server, i)->name);
             server_remove_client(server, i);
             --i;
@@ -382,6 +1117,7 @@ void server_remove_disconnected(server_t *server, int disconnect_secs) {
     // broadcast that the client was disconnected to remaining clients
     for (int i = 0; i < cnt; ++i) {
         strcpy(mesg.name, disconnected_name_list[i]);
+        mesg.sender = disconnected_id_list[i];
         server_broadcast(server, &mesg);
     }
 }
@@ -402,18 +1138,1331 @@ void server_write_who(server_t *server) {
     for (int i = 0; i < server->n_clients; ++i) {
         strcpy(who.names[i], server_get_client(server, i)->name);
     }
+    long start_ns = clock_ns();
     sem_wait(server->log_sem);
     pwrite(server->log_fd, &who, sizeof(who_t), 0);
     sem_post(server->log_sem);
+    server_watch(server, WATCH_WHO, -1, server->log_fd, start_ns);
 }
 
 // ADVANCED: Write the given message to the end of log file associated
-// with the server.
+// with the server. Messages are logged in the same encoding sent to
+// clients so chat messages are logged with their sender's id which
+// readers resolve from the JOINED messages before them.
 void server_log_message(server_t *server, mesg_t *mesg) {
+    char buf[FRAME_MAX];
+    int len = mesg_encode(mesg, mesg->kind != BL_MESG, buf);
+    long start_ns = clock_ns();
+    PROBE2(log_start, mesg->kind, len);
     sem_wait(server->log_sem);
     long f_offset = lseek(server->log_fd, 0, SEEK_END);
-    long n_write = pwrite(server->log_fd, mesg, sizeof(mesg_t), f_offset);
+    long n_write = pwrite(server->log_fd, buf, len, f_offset);
     check_fail(n_write == -1, 1, "write to fd %d error.\n", server->log_fd);
     sem_post(server->log_sem);
+    PROBE2(log_done, mesg->kind, len);
+    server_watch(server, WATCH_LOG, -1, server->log_fd, start_ns);
+}
+
+
+// Forward one chunk of a message streamed by the client at idx and,
+// in advanced mode, write it into the message's log record. The first
+// chunk gives the total length in seq. The whole record is reserved in
+// the log then, so messages logged while the stream runs come after
+// it, and each chunk is written into place as it arrives. Chunks past
+// the given length are cut off; a record whose sender leaves early
+// ends in zeros. The record's sequence number is that of the last
+// chunk so a restarted server numbers on from there.
+void server_stream_chunk(server_t *server, int idx, mesg_t *mesg) {
+    client_t *client = server_get_client(server, idx);
+    int total = 0; // length given by the first chunk, unsigned on the wire
+    if (mesg->flags & WIRE_FIRST) {
+        total = (uint32_t) mesg->seq < STREAM_MAX ? (uint32_t) mesg->seq : STREAM_MAX;
+        client->streaming = 1;
+        client->stream_left = total;
+        client->stream_off = -1;
+    } else if (!client->streaming) {
+        dbg_printf("server_stream_chunk: %s sent a chunk outside a stream\n", client->name);
+        return;
+    }
+    int len = strlen(mesg->body);
+    if (len > client->stream_left) {
+        len = client->stream_left;
+        mesg->body[len] = '\0';
+    }
+    client->stream_left -= len;
+    if (client->stream_left == 0) {
+        mesg->flags |= WIRE_LAST;
+    }
+    if (mesg->flags & WIRE_LAST) {
+        client->streaming = 0;
+    }
+    server_broadcast(server, mesg);
+
+    if (!DO_ADVANCED) {
+        return;
+    }
+    if (mesg->flags & WIRE_FIRST) { // header now, body space for what is to come
+        mesg_t rec = *mesg;
+        rec.flags = WIRE_FIRST | WIRE_LAST;
+        rec.body[0] = '\0';
+        char buf[FRAME_MAX];
+        int hlen = mesg_encode(&rec, 0, buf);
+        wire_hdr_t hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        hdr.body_len = total;
+        memcpy(buf, &hdr, sizeof(hdr));
+        sem_wait(server->log_sem);
+        long f_offset = lseek(server->log_fd, 0, SEEK_END);
+        long n_write = pwrite(server->log_fd, buf, hlen, f_offset);
+        check_fail(n_write == -1, 1, "write to fd %d error.\n", server->log_fd);
+        check_fail(ftruncate(server->log_fd, f_offset + hlen + hdr.body_len) == -1, 1, "extend log error.\n");
+        sem_post(server->log_sem);
+        client->stream_rec = f_offset;
+        client->stream_off = f_offset + hlen;
+    }
+    if (client->stream_off != -1 && len > 0) {
+        long n_write = pwrite(server->log_fd, mesg->body, len, client->stream_off);
+        check_fail(n_write == -1, 1, "write to fd %d error.\n", server->log_fd);
+        client->stream_off += len;
+    }
+    if (client->stream_off != -1 && (mesg->flags & WIRE_LAST)) { // the record takes the last chunk's number
+        uint32_t seq = mesg->seq;
+        pwrite(server->log_fd, &seq, sizeof(seq), client->stream_rec + offsetof(wire_hdr_t, seq));
+    }
+}
+
+// Relay the attachment announced by mesg, whose seq bytes follow it on
+// the to-server FIFO of the client at idx, to every other client
+// granted CAP_ATTACH without copying it through user space. Each
+// recipient has a private pipe whose read end travels with the
+// BL_ATTACH queued for it; flush_lanes() splices the file out of the
+// pipe into the recipient's FIFO once everything queued ahead of it is
+// written. Here the relay is only set up: the bytes are moved by
+// server_relay_input() as they arrive, between the server's other
+// work, and the relay ends with server_relay_end(). In advanced mode
+// the log gets a BL_ATTACH record naming the spool file.
+void server_relay_attachment(server_t *server, int idx, mesg_t *mesg) {
+    client_t *client = server_get_client(server, idx);
+    long size = (uint32_t) mesg->seq;
+    if (size > ATTACH_MAX) { // where it ends cannot be trusted
+        log_printf("client %d '%s' attachment too large\n", idx, mesg->name);
+        mesg->kind = BL_DISCONNECTED;
+        server_remove_client(server, idx);
+        server_broadcast(server, mesg);
+        return;
+    }
+    char *slash = strrchr(mesg->body, '/'); // only the base name travels
+    if (slash != NULL) {
+        memmove(mesg->body, slash + 1, strlen(slash + 1) + 1);
+    }
+
+    client->attach_rec = *mesg; // log record pointing at the spool file
+    client->attach_rec.seq = ++server->last_seq;
+    if (DO_ADVANCED) {
+        char spool[MAXPATH + MAXLINE + 16];
+        snprintf(spool, sizeof(spool), "%s-%d-%s", server->server_name, client->attach_rec.seq, mesg->body);
+        spool[MAXLINE - 1] = '\0'; // as much as the record holds
+        strcpy(client->attach_rec.body, spool);
+        client->attach_sink = open(client->attach_rec.body, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        client->attach_sink = open("/dev/null", O_WRONLY);
+    }
+    check_fail(client->attach_sink == -1, 1, "open attachment spool error.\n");
+    client->attach_left = client->attach_size = size;
+    client->attach_n = 0;
+
+    int pipe_size = fcntl(client->to_server_fd, F_GETPIPE_SZ);
+    for (int i = 0; i < server->n_clients && size > 0; ++i) {
+        client_t *to = server_get_client(server, i);
+        if (i == idx || !(to->caps & CAP_ATTACH) || !server_filter_pass(&to->filter, mesg)) {
+            continue;
+        }
+        char buf[FRAME_MAX];
+        int len = mesg_encode_for(mesg, to->enc, 1, buf);
+        int fds[2];
+        check_fail(pipe(fds) == -1, 1, "pipe error.\n");
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_size); // holds all the FIFO can
+        frame_t *frame = frame_new(buf, len);
+        frame->attach_fd = fds[0];
+        frame->attach_len = size;
+        if (server_enqueue(server, i, frame, 0) != 0) { // dropped along with the read end
+            close(fds[1]);
+            continue;
+        }
+        client->attach_to[client->attach_n] = to->id;
+        client->attach_pipe[client->attach_n] = fds[1];
+        client->attach_ahead[client->attach_n++] = 0;
+        server_flush_client(server, i, 0);
+    }
+    if (size == 0) {
+        server_relay_end(server, idx);
+    }
+}
+
+// Move what has arrived of the attachment the client at idx is sending
+// on to its recipients. The input is tee()d into the pipe of each
+// recipient which has had everything taken so far; a pipe with little
+// room takes a short copy and the rest is copied next time. Only what
+// every recipient has is then spliced out of the FIFO into the sink,
+// so the slowest recipient paces the sender without holding up anyone
+// else. A recipient whose pipe fails is left out and gets zeros for
+// the rest of the file. Ends the relay once the whole file is taken.
+void server_relay_input(server_t *server, int idx) {
+    long start_ns = clock_ns();
+    client_t *client = server_get_client(server, idx);
+    client->data_ready = 0;
+    int avail = 0;
+    ioctl(client->to_server_fd, FIONREAD, &avail);
+    long n = avail < client->attach_left ? avail : client->attach_left;
+    long least = n;
+    for (int j = 0; j < client->attach_n; ++j) {
+        if (client->attach_ahead[j] == 0 && n > 0) {
+            long n_tee = tee(client->to_server_fd, client->attach_pipe[j], n, SPLICE_F_NONBLOCK);
+            if (n_tee == -1 && errno != EAGAIN) {
+                dbg_printf("server_relay_input: tee to client id %d failed: %s\n", client->attach_to[j], strerror(errno));
+                close(client->attach_pipe[j]);
+                client->attach_n--;
+                client->attach_to[j] = client->attach_to[client->attach_n];
+                client->attach_pipe[j] = client->attach_pipe[client->attach_n];
+                client->attach_ahead[j--] = client->attach_ahead[client->attach_n];
+                continue;
+            }
+            client->attach_ahead[j] = n_tee > 0 ? n_tee : 0;
+        }
+        if (client->attach_ahead[j] < least) {
+            least = client->attach_ahead[j];
+        }
+    }
+    for (long done = 0; done < least; ) { // every copy is made, consume the input
+        long n_splice = splice(client->to_server_fd, NULL, client->attach_sink, NULL, least - done, SPLICE_F_MOVE);
+        check_fail(n_splice <= 0, 1, "splice attachment error.\n");
+        done += n_splice;
+    }
+    for (int j = 0; j < client->attach_n; ++j) {
+        client->attach_ahead[j] -= least;
+    }
+    client->attach_left -= least;
+    client->stats.bytes_in += least;
+    client->last_contact_ns = server->now_ns;
+    for (int i = 0; i < server->n_clients; ++i) { // recipients waiting on the sender take what came
+        if (file_waiting(server_get_client(server, i)) != NULL) {
+            server_flush_client(server, i, 0);
+        }
+    }
+    if (client->attach_left == 0) {
+        server_relay_end(server, idx);
+    }
+    server_watch(server, WATCH_CLIENT, idx, client->to_server_fd, start_ns);
+}
+
+// End the attachment relay of the client at idx, complete or not.
+// Closing the recipients' pipes makes flush_lanes() write zeros for
+// whatever the sender did not provide; in advanced mode the spool file
+// is made up to size the same way and the record is logged.
+void server_relay_end(server_t *server, int idx) {
+    client_t *client = server_get_client(server, idx);
+    for (int j = 0; j < client->attach_n; ++j) {
+        close(client->attach_pipe[j]);
+    }
+    client->attach_n = 0;
+    if (DO_ADVANCED) {
+        ftruncate(client->attach_sink, client->attach_size);
+        server_log_message(server, &client->attach_rec);
+    }
+    close(client->attach_sink);
+    client->attach_left = 0;
+}
+
+// Load the phrases in the rules file, server_name.rules, if it has
+// changed since they were last loaded so moderators can edit it while
+// the server runs; removing the file drops the rules. The file is
+// looked at no more than once a second.
+void server_check_rules(server_t *server) {
+    if (server->rules_checked != 0 && server->now_ns - server->rules_checked < NANOS_PER_SEC) {
+        return;
+    }
+    server->rules_checked = server->now_ns;
+    char fname[MAXPATH + 8];
+    snprintf(fname, sizeof(fname), "%s.rules", server->server_name);
+    struct stat st;
+    if (stat(fname, &st) == -1) {
+        if (server->rules != NULL) {
+            log_printf("rules file %s removed\n", fname);
+            matcher_free(server->rules);
+            server->rules = NULL;
+            memset(&server->rules_mtime, 0, sizeof(server->rules_mtime));
+        }
+        return;
+    }
+    if (st.st_mtim.tv_sec == server->rules_mtime.tv_sec && st.st_mtim.tv_nsec == server->rules_mtime.tv_nsec) {
+        return;
+    }
+    matcher_t *rules = matcher_load(fname);
+    if (rules == NULL) {
+        return;
+    }
+    matcher_free(server->rules);
+    server->rules = rules;
+    server->rules_mtime = st.st_mtim;
+    log_printf("loaded %d rules from %s\n", rules->n_patterns, fname);
+}
+
+// Returns 1 if a client with the given filter receives mesg. Kinds are
+// checked against a bitmask and senders against a bitmap so this costs
+// a few instructions unless a keyword is set.
+int server_filter_pass(filter_t *filter, mesg_t *mesg) {
+    if (!(filter->kinds & KIND_BIT(mesg->kind))) {
+        return 0;
+    }
+    int chat = mesg->kind == BL_MESG || mesg->kind == BL_CHUNK || mesg->kind == BL_ATTACH;
+    if (chat && (filter->muted[mesg->sender / 8] & (1 << mesg->sender % 8))) {
+        return 0;
+    }
+    if (filter->keyword[0] != '\0' && mesg->kind == BL_MESG && strstr(mesg->body, filter->keyword) == NULL) {
+        return 0;
+    }
+    return 1;
+}
+
+// Change the filter of the client at idx as the words of spec say:
+//   kinds KIND...  receive only these of mesg joined departed
+//                  disconnected chunk attach
+//   mute NAME      receive no chat from clients called NAME, up to
+//                  MUTE_MAX names, including any joining later
+//   unmute NAME    receive chat from NAME again
+//   keyword WORD   receive only chat messages containing WORD
+//   clear          receive everything again
+// Anything else is ignored. Control messages always get through.
+void server_set_filter(server_t *server, int idx, char *spec) {
+    static char *kind_names[] = {"mesg", "joined", "departed", "disconnected", "chunk", "attach"};
+    static mesg_kind_t kinds[] = {BL_MESG, BL_JOINED, BL_DEPARTED, BL_DISCONNECTED, BL_CHUNK, BL_ATTACH};
+    filter_t *filter = &server_get_client(server, idx)->filter;
+    char *save, *word = strtok_r(spec, " ", &save);
+    if (word == NULL) {
+        return;
+    }
+    if (strcmp(word, "kinds") == 0) {
+        filter->kinds = FILTER_ALWAYS;
+        while ((word = strtok_r(NULL, " ", &save)) != NULL) {
+            for (int k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+                if (strcmp(word, kind_names[k]) == 0) {
+                    filter->kinds |= KIND_BIT(kinds[k]);
+                }
+            }
+        }
+    } else if (strcmp(word, "mute") == 0 || strcmp(word, "unmute") == 0) {
+        int mute = word[0] == 'm';
+        char *name = strtok_r(NULL, "", &save);
+        for (int m = 0; name != NULL && m < MUTE_MAX; ++m) { // kept for clients joining later
+            if (mute && filter->mute_names[m][0] == '\0') {
+                strncpy(filter->mute_names[m], name, MAXNAME - 1);
+                break;
+            } else if (!mute && strcmp(filter->mute_names[m], name) == 0) {
+                filter->mute_names[m][0] = '\0';
+            }
+        }
+        for (int i = 0; name != NULL && i < server->n_clients; ++i) {
+            int id = server_get_client(server, i)->id;
+            if (strcmp(server_get_client(server, i)->name, name) != 0) {
+                continue;
+            }
+            if (mute) {
+                filter->muted[id / 8] |= 1 << id % 8;
+            } else {
+                filter->muted[id / 8] &= ~(1 << id % 8);
+            }
+        }
+    } else if (strcmp(word, "keyword") == 0) {
+        char *keyword = strtok_r(NULL, "", &save);
+        strncpy(filter->keyword, keyword != NULL ? keyword : "", MAXNAME - 1);
+    } else if (strcmp(word, "clear") == 0) {
+        memset(filter, 0, sizeof(filter_t));
+        filter->kinds = FILTER_ALL;
+    }
+    dbg_printf("server_set_filter: client %d kinds %x keyword '%s'\n", idx, filter->kinds, filter->keyword);
+}
+
+// Returns 1 if any client's queued chat output is over half of
+// OUTQ_LEN. Streaming senders are not read from while this is so and
+// their writes block once their FIFOs fill.
+int server_output_backlog(server_t *server) {
+    for (int i = 0; i < server->n_clients; ++i) {
+        if (server_get_client(server, i)->data_lane.count > OUTQ_LEN / 2) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Keep the given message in the history ring, replacing the oldest
+// message once HISTORY_LEN are kept.
+void server_history_add(server_t *server, mesg_t *mesg) {
+    int pos = (server->hist_start + server->hist_count) % HISTORY_LEN;
+    server->history[pos] = *mesg;
+    if (server->hist_count < HISTORY_LEN) {
+        server->hist_count++;
+    } else {
+        server->hist_start = (server->hist_start + 1) % HISTORY_LEN;
+    }
+}
+
+// Queue every message in the history with a sequence number after
+// after_seq which its filter passes to the client at idx only. Used
+// when a client rejoins so it receives just the messages it missed, as
+// it would have had it stayed; anything older than the history is lost.
+void server_replay(server_t *server, int idx, int after_seq) {
+    int n_replay = 0;
+    filter_t *filter = &server_get_client(server, idx)->filter;
+    for (int i = 0; i < server->hist_count; ++i) {
+        mesg_t *mesg = &server->history[(server->hist_start + i) % HISTORY_LEN];
+        if (mesg->seq > after_seq && mesg_is_history(mesg->kind) && server_filter_pass(filter, mesg)) { // sent with names, ids may have been reused since
+            server_send_client(server, idx, mesg);
+            n_replay++;
+        }
+    }
+    dbg_printf("server_replay: %d messages after %d\n", n_replay, after_seq);
+}
+
+// ADVANCED: Fill the history with the latest messages in the log from
+// offset on and continue sequence numbers after the last one logged so
+// clients of a previous run can resume. Names of senders are looked up
+// in names, which holds those announced before offset.
+void server_load_history(server_t *server, long offset, name_table_t *names) {
+    static char buf[RECV_BUFSIZE];
+    mesg_t mesg;
+    int have = 0, used = 0, n_read;
+    while ((n_read = pread(server->log_fd, buf + have, sizeof(buf) - have, offset)) > 0) {
+        offset += n_read;
+        have += n_read;
+        for (int n; (n = mesg_decode(buf + used, have - used, &mesg, names)) > 0; used += n) {
+            if (mesg.kind != BL_ATTACH && mesg_is_history(mesg.kind)) { // the file stays in its spool, not replayed; older logs hold SHUTDOWN
+                server_history_add(server, &mesg);
+            }
+            if (mesg.seq > server->last_seq) {
+                server->last_seq = mesg.seq;
+            }
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+        used = 0;
+    }
+}
+
+// Read and carry out the commands waiting on the admin FIFO, one per
+// line. Called from the main loop between rounds of client traffic.
+void server_handle_admin(server_t *server) {
+    char buf[PIPE_BUF + 1];
+    server->admin_ready = 0;
+    long start_ns = clock_ns();
+    int n_read = read(server->admin_fd, buf, PIPE_BUF);
+    if (n_read <= 0) {
+        return;
+    }
+    buf[n_read] = '\0';
+    char *save;
+    for (char *line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        server_admin_command(server, line);
+    }
+    server_watch(server, WATCH_ADMIN, -1, server->admin_fd, start_ns);
+}
+
+// Carry out one admin command:
+//   ping SECS          ADVANCED: seconds between pings, below disconnect
+//   disconnect SECS    seconds of silence before a client is dropped,
+//                      passed on to clients with the pings
+//   stall MSECS        work taking this long is logged as a stall
+//   log on|off         LOG: messages, as BL_NOLOG
+//   debug on|off       DEBUG: messages, as BL_DEBUG
+//   advanced on|off    log, pings and roster, as BL_ADVANCED
+//   kick NAME          disconnect the clients called NAME
+//   flush              write queued output, waiting up to
+//                      ADMIN_FLUSH_MSECS, and sync the log
+//   stats              write counters to server_name.stats
+//   top [N] [KEY]      write the N clients with most KEY, one of the
+//                      keys of server_write_top(), to server_name.top
+//   who                write the roster to the log now
+//   snapshot           ADVANCED: write server_name.snap now
+//   upgrade [PATH]     hand everything over to PATH, by default the
+//                      program the server was started from
+// Unknown commands are logged and ignored.
+void server_admin_command(server_t *server, char *line) {
+    char *save, *cmd = strtok_r(line, " ", &save);
+    char *arg = strtok_r(NULL, "", &save);
+    if (cmd == NULL) {
+        return;
+    }
+    int on = arg != NULL && strcmp(arg, "on") == 0;
+    log_printf("admin: %s%s%s\n", cmd, arg != NULL ? " " : "", arg != NULL ? arg : "");
+    if (strcmp(cmd, "ping") == 0 && arg != NULL && atoi(arg) > 0) {
+        if (atoi(arg) >= server->disconnect_secs) { // every client would be dropped between pings
+            log_printf("admin: ping must be below disconnect %d\n", server->disconnect_secs);
+            return;
+        }
+        server->ping_interval = atoi(arg);
+        if (DO_ADVANCED) {
+            alarm(server->ping_interval);
+        }
+    } else if (strcmp(cmd, "disconnect") == 0 && arg != NULL && atoi(arg) > 0) {
+        if (atoi(arg) <= server->ping_interval) {
+            log_printf("admin: disconnect must be above ping %d\n", server->ping_interval);
+            return;
+        }
+        server->disconnect_secs = atoi(arg);
+    } else if (strcmp(cmd, "stall") == 0 && arg != NULL && atoi(arg) > 0) {
+        server->stall_min_ns = atol(arg) * (NANOS_PER_SEC / 1000);
+    } else if (strcmp(cmd, "log") == 0 && arg != NULL) {
+        if (on) {
+            unsetenv("BL_NOLOG");
+        } else {
+            setenv("BL_NOLOG", "1", 1);
+        }
+    } else if (strcmp(cmd, "debug") == 0 && arg != NULL) {
+        if (on) {
+            setenv("BL_DEBUG", "1", 1);
+        } else {
+            unsetenv("BL_DEBUG");
+        }
+    } else if (strcmp(cmd, "advanced") == 0 && arg != NULL && on != DO_ADVANCED) {
+        if (on) {
+            DO_ADVANCED = 1;
+            server_open_log(server);
+            alarm(server->ping_interval);
+        } else {
+            alarm(0);
+            server_close_log(server);
+            DO_ADVANCED = 0;
+        }
+    } else if (strcmp(cmd, "kick") == 0 && arg != NULL) {
+        server_kick(server, arg);
+    } else if (strcmp(cmd, "flush") == 0) {
+        long deadline_ns = clock_ns() + ADMIN_FLUSH_MSECS * (NANOS_PER_SEC / 1000); // for all, stuck clients keep the rest
+        for (int i = 0; i < server->n_clients; ++i) {
+            server_flush_until(server, i, deadline_ns);
+        }
+        if (DO_ADVANCED) {
+            fsync(server->log_fd);
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        server_write_stats(server);
+    } else if (strcmp(cmd, "top") == 0) {
+        char *key = arg != NULL ? strtok_r(arg, " ", &save) : NULL;
+        int n = key != NULL && isdigit(key[0]) ? atoi(key) : TOP_DEFAULT;
+        if (key != NULL && isdigit(key[0])) {
+            key = strtok_r(NULL, " ", &save);
+        }
+        server_write_top(server, n, key != NULL ? key : "bytes_in");
+    } else if (strcmp(cmd, "who") == 0 && DO_ADVANCED) {
+        server_write_who(server);
+    } else if (strcmp(cmd, "snapshot") == 0 && DO_ADVANCED) {
+        server->snap_time = server->time_sec - SNAPSHOT_SECS;
+        server_snapshot(server, 0);
+    } else if (strcmp(cmd, "upgrade") == 0) {
+        server_upgrade(server, arg != NULL ? arg : server->exe_path);
+    } else {
+        log_printf("admin: unknown command '%s'\n", cmd);
+    }
+}
+
+// Disconnect every client called name: it is sent BL_SHUTDOWN so it
+// stops, then removed, and the others see it DISCONNECTED.
+void server_kick(server_t *server, char *name) {
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg));
+    for (int i = server->n_clients - 1; i >= 0; --i) {
+        client_t *client = server_get_client(server, i);
+        if (strcmp(client->name, name) != 0) {
+            continue;
+        }
+        mesg.kind = BL_SHUTDOWN;
+        server_send_client(server, i, &mesg);
+        server_flush_until(server, i, clock_ns() + ADMIN_FLUSH_MSECS * (NANOS_PER_SEC / 1000)); // a stuck client goes anyway
+        server_disconnect_client(server, i);
+    }
+}
+
+// Disconnect the clients marked stuck by server_enqueue(), which lost
+// output as they stopped reading.
+void server_drop_stuck(server_t *server) {
+    for (int i = server->n_clients - 1; i >= 0; --i) {
+        if (server_get_client(server, i)->stuck) {
+            log_printf("client %d '%s' stopped reading, disconnected\n", i, server_get_client(server, i)->name);
+            server_disconnect_client(server, i);
+            i = server->n_clients; // telling the others may have left more stuck
+        }
+    }
+}
+
+// Remove the client at idx, dropping its queued output and whatever it
+// sent which is still unread, and tell the others it was disconnected.
+void server_disconnect_client(server_t *server, int idx) {
+    mesg_t mesg;
+    memset(&mesg, 0, sizeof(mesg));
+    mesg.kind = BL_DISCONNECTED;
+    mesg.sender = server_get_client(server, idx)->id;
+    strcpy(mesg.name, server_get_client(server, idx)->name);
+    server_remove_client(server, idx);
+    server_broadcast(server, &mesg);
+}
+
+// Write the server's settings and counters and a line per client to
+// server_name.stats, replacing what was there.
+void server_write_stats(server_t *server) {
+    char fname[MAXPATH + 8];
+    snprintf(fname, sizeof(fname), "%s.stats", server->server_name);
+    FILE *out = fopen(fname, "w");
+    if (out == NULL) {
+        log_printf("admin: cannot write %s\n", fname);
+        return;
+    }
+    fprintf(out, "advanced %d\nping_interval %d\ndisconnect_secs %d\n",
+            DO_ADVANCED, server->ping_interval, server->disconnect_secs);
+    fprintf(out, "pool %d free of %d wanted\n", server->pool_free, server->pool_target);
+    fprintf(out, "uptime %.3f\nlast_seq %d\nhistory %d\nrules %d\nclients %d\n",
+            (double) (server->now_ns - server->start_ns) / NANOS_PER_SEC, server->last_seq, server->hist_count,
+            server->rules != NULL ? server->rules->n_patterns : 0, server->n_clients);
+    for (int i = 0; i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, i);
+        fprintf(out, "client %d id %d name %s version %d caps %d queued %d+%d idle %.3f pipes %d/%d stalls %ld %.3f\n",
+                i, client->id, client->name, client->version, client->caps,
+                client->ctl_lane.count, client->data_lane.count,
+                (double) (server->now_ns - client->last_contact_ns) / NANOS_PER_SEC,
+                client->out_pipe, client->in_pipe, client->stalls, (double) client->stall_ns / NANOS_PER_SEC);
+        client_stats_t *st = &client->stats;
+        fprintf(out, "  in %ld/%ld out %ld/%ld missed %ld queue_peak %d connected %.3f\n",
+                st->mesgs_in, st->bytes_in, st->mesgs_out, st->bytes_out, st->pings_missed,
+                st->queue_peak, (double) (server->now_ns - st->joined_ns) / NANOS_PER_SEC);
+    }
+    fprintf(out, "stall_msecs %ld\n", server->stall_min_ns / (NANOS_PER_SEC / 1000));
+    for (int what = 0; what < N_WATCH; ++what) {
+        if (server->stalls[what] > 0) {
+            fprintf(out, "stall %s n %ld total %.3f\n", watch_names[what], server->stalls[what],
+                    (double) server->stall_ns[what] / NANOS_PER_SEC);
+        }
+    }
+    for (int hop = 0; hop < N_TRACE_HOPS; ++hop) {
+        char line[MAXLINE];
+        if (hist_format(&server->trace[hop], hop, line, sizeof(line)) > 0) {
+            fputs(line, out);
+        }
+    }
+    fclose(out);
+}
+
+// Keys server_write_top() sorts clients by, in the order of the
+// values top_value() gives.
+static char *top_keys[] = {
+    "mesgs_in", "bytes_in", "mesgs_out", "bytes_out", "missed", "queue_peak", "connected",
+};
+#define N_TOP_KEYS (sizeof(top_keys) / sizeof(top_keys[0]))
+
+// Returns the value of the client's counter at index key of top_keys.
+static long top_value(server_t *server, client_t *client, int key) {
+    client_stats_t *st = &client->stats;
+    long values[N_TOP_KEYS] = {
+        st->mesgs_in, st->bytes_in, st->mesgs_out, st->bytes_out, st->pings_missed,
+        st->queue_peak, server->now_ns - st->joined_ns,
+    };
+    return values[key];
+}
+
+// Write the n clients with the largest counter named key, one of
+// top_keys, most first, to server_name.top, replacing what was there.
+void server_write_top(server_t *server, int n, char *key) {
+    int k = 0;
+    while (k < N_TOP_KEYS && strcmp(top_keys[k], key) != 0) {
+        k++;
+    }
+    if (k == N_TOP_KEYS) {
+        log_printf("admin: top: unknown key '%s'\n", key);
+        return;
+    }
+    int order[MAXCLIENTS];
+    long values[MAXCLIENTS];
+    for (int i = 0; i < server->n_clients; ++i) { // insertion sort, few clients
+        values[i] = top_value(server, server_get_client(server, i), k);
+        int j = i;
+        for (; j > 0 && values[order[j - 1]] < values[i]; --j) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    char fname[MAXPATH + 8];
+    snprintf(fname, sizeof(fname), "%s.top", server->server_name);
+    FILE *out = fopen(fname, "w");
+    if (out == NULL) {
+        log_printf("admin: cannot write %s\n", fname);
+        return;
+    }
+    fprintf(out, "top %d by %s of %d clients\n", n, key, server->n_clients);
+    fprintf(out, "%-16s %10s %12s %10s %12s %8s %10s %10s\n", "name",
+            "mesgs_in", "bytes_in", "mesgs_out", "bytes_out", "missed", "queue_peak", "connected");
+    for (int i = 0; i < n && i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, order[i]);
+        client_stats_t *st = &client->stats;
+        fprintf(out, "%-16s %10ld %12ld %10ld %12ld %8ld %10d %10.3f\n", client->name,
+                st->mesgs_in, st->bytes_in, st->mesgs_out, st->bytes_out, st->pings_missed,
+                st->queue_peak, (double) (server->now_ns - st->joined_ns) / NANOS_PER_SEC);
+    }
+    fclose(out);
+}
+
+// Send len bytes at data as one packet on the upgrade socket with the
+// n_fds descriptors in fds attached. Returns 0 on success.
+static int upgrade_send(int sock, void *data, int len, int *fds, int n_fds) {
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    char ctl[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (n_fds > 0) {
+        msg.msg_control = ctl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// Receive one packet of at most len bytes from the upgrade socket into
+// data and up to 3 descriptors into fds, setting *n_fds. Returns the
+// bytes received or -1.
+static int upgrade_recv(int sock, void *data, int len, int *fds, int *n_fds) {
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    char ctl[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl)};
+    int n_read = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    *n_fds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n_read > 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+        *n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *n_fds);
+    }
+    return n_read;
+}
+
+// Send each frame queued on the lane, oldest first.
+static int upgrade_send_lane(int sock, lane_t *lane) {
+    for (int k = 0; k < lane->count; ++k) {
+        frame_t *frame = lane->frames[(lane->head + k) % OUTQ_LEN];
+        if (upgrade_send(sock, frame->data, frame->len, NULL, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Run in a child forked by server_upgrade(): send the server's state
+// and descriptors to the new server on sock and wait for it to take
+// them. The child holds the client FIFOs open meanwhile so clients see
+// no end of file. Returns 0 if the new server acknowledged.
+static int server_hand_over(server_t *server, int sock) {
+    upgrade_t up;
+    memset(&up, 0, sizeof(up));
+    up.magic = UPGRADE_MAGIC;
+    up.pid = getpid();
+    up.advanced = DO_ADVANCED;
+    up.n_clients = server->n_clients;
+    up.hist_count = server->hist_count;
+    up.last_seq = server->last_seq;
+    up.start_time_sec = server->start_time_sec;
+    up.start_ns = server->start_ns;
+    up.ping_interval = server->ping_interval;
+    up.disconnect_secs = server->disconnect_secs;
+    memcpy(up.id_used, server->id_used, sizeof(up.id_used));
+    int fds[3] = {server->join_fd, server->admin_fd, server->log_fd};
+    if (upgrade_send(sock, &up, sizeof(up), fds, DO_ADVANCED ? 3 : 2) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, i);
+        upgrade_client_t uc;
+        memset(&uc, 0, sizeof(uc));
+        strcpy(uc.name, client->name);
+        strcpy(uc.to_client_fname, client->to_client_fname);
+        strcpy(uc.to_server_fname, client->to_server_fname);
+        uc.id = client->id;
+        uc.version = client->version;
+        uc.caps = client->caps;
+        uc.enc = client->enc;
+        uc.streaming = client->streaming;
+        uc.stream_left = client->stream_left;
+        uc.stream_rec = client->stream_rec;
+        uc.stream_off = client->stream_off;
+        uc.filter = client->filter;
+        uc.pool_slot = client->pool_slot;
+        uc.last_contact_ns = client->last_contact_ns;
+        uc.stats = client->stats;
+        uc.ctl_count = client->ctl_lane.count;
+        uc.ctl_off = client->ctl_lane.off;
+        uc.data_count = client->data_lane.count;
+        uc.data_off = client->data_lane.off;
+        int cfds[2] = {client->to_client_fd, client->to_server_fd};
+        if (upgrade_send(sock, &uc, sizeof(uc), cfds, 2) != 0 ||
+            upgrade_send_lane(sock, &client->ctl_lane) != 0 ||
+            upgrade_send_lane(sock, &client->data_lane) != 0) {
+            return 1;
+        }
+    }
+
+    for (int k = 0; k < server->hist_count; ++k) {
+        mesg_t *mesg = &server->history[(server->hist_start + k) % HISTORY_LEN];
+        if (upgrade_send(sock, mesg, sizeof(mesg_t), NULL, 0) != 0) {
+            return 1;
+        }
+    }
+    char ack;
+    return read(sock, &ack, 1) == 1 ? 0 : 1;
+}
+
+// Set or clear close-on-exec on every descriptor the server holds.
+static void server_set_cloexec(server_t *server, int on) {
+    int fds[3 + 2 * MAXCLIENTS], n = 0;
+    fds[n++] = server->join_fd;
+    fds[n++] = server->admin_fd;
+    if (DO_ADVANCED) {
+        fds[n++] = server->log_fd;
+    }
+    for (int i = 0; i < server->n_clients; ++i) {
+        fds[n++] = server->client[i].to_client_fd;
+        fds[n++] = server->client[i].to_server_fd;
+    }
+    for (int k = 0; k < POOL_MAX; ++k) {
+        if (server->pool[k].state == POOL_FREE) { // reopened by name, see server_resume()
+            fcntl(server->pool[k].to_client_fd, F_SETFD, on ? FD_CLOEXEC : 0);
+            fcntl(server->pool[k].to_server_fd, F_SETFD, on ? FD_CLOEXEC : 0);
+        }
+    }
+    for (int k = 0; k < n; ++k) {
+        fcntl(fds[k], F_SETFD, on ? FD_CLOEXEC : 0);
+    }
+}
+
+// Replace the running server with the program at path without clients
+// noticing. A forked copy of the server passes the state and open
+// descriptors over a socket with SCM_RIGHTS while this process execs
+// path, keeping its pid, and picks them up in server_start(). Output
+// queued for clients is carried over, not flushed, so a stalled client
+// cannot hold up the upgrade. Attachments being relayed live in pipes
+// which are not handed over, so the upgrade waits until none is. Returns
+// only if the upgrade failed, in which case the server carries on as it
+// was.
+int server_upgrade(server_t *server, char *path) {
+    log_printf("BEGIN: server_upgrade()\n");
+    for (int i = 0; i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, i);
+        int busy = client->attach_left > 0;
+        for (int k = 0; k < client->data_lane.count; ++k) {
+            busy |= client->data_lane.frames[(client->data_lane.head + k) % OUTQ_LEN]->attach_fd != -1;
+        }
+        if (busy) {
+            log_printf("upgrade: client %d '%s' has an attachment under way, try again later\n", i, client->name);
+            log_printf("END: server_upgrade()\n");
+            return 1;
+        }
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        log_printf("upgrade: socketpair failed: %s\n", strerror(errno));
+        log_printf("END: server_upgrade()\n");
+        return 1;
+    }
+    alarm(0); // SIGALRM would end the new program before it sets a handler
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL); // an interrupt meant for the server must not shut it down from here
+        signal(SIGTERM, SIG_DFL);
+        close(sv[1]);
+        _exit(server_hand_over(server, sv[0]));
+    }
+    close(sv[0]);
+    if (pid != -1) {
+        server_set_cloexec(server, 1);
+        char fd_str[16];
+        snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+        setenv("BL_UPGRADE_FD", fd_str, 1);
+        char *argv[] = {path, server->server_name, NULL};
+        log_printf("upgrade: exec %s\n", path);
+        sigset_t blocked;
+        sigprocmask(SIG_SETMASK, &server->poll_mask, &blocked); // the mask survives exec
+        execv(path, argv);
+        sigprocmask(SIG_SETMASK, &blocked, NULL);
+        unsetenv("BL_UPGRADE_FD");
+        server_set_cloexec(server, 0);
+    }
+    log_printf("upgrade: cannot run %s: %s\n", path, strerror(errno));
+    close(sv[1]); // the child sees end of file and quits
+    if (pid != -1) {
+        waitpid(pid, NULL, 0);
+    }
+    if (DO_ADVANCED) {
+        alarm(server->ping_interval);
+    }
+    log_printf("END: server_upgrade()\n");
+    return 1;
+}
+
+// Receive the next frame for a lane from the upgrade socket and queue
+// it there.
+static void upgrade_recv_frame(int sock, lane_t *lane) {
+    char buf[FRAME_MAX];
+    int fds[3], n_fds;
+    int len = upgrade_recv(sock, buf, sizeof(buf), fds, &n_fds);
+    check_fail(len <= 0, 1, "upgrade: frame missing.\n");
+    frame_t *frame = frame_new(buf, len);
+    lane->frames[(lane->head + lane->count) % OUTQ_LEN] = frame;
+    lane->count++;
+    frame->refs++;
+}
+
+// Take over from an old server which is sending its state on sock,
+// see server_upgrade(). The FIFOs, log and semaphore stay as they
+// were; only the process serving them changes.
+void server_resume(server_t *server, int sock) {
+    upgrade_t up;
+    int fds[3], n_fds;
+    int len = upgrade_recv(sock, &up, sizeof(up), fds, &n_fds);
+    check_fail(len != sizeof(up) || up.magic != UPGRADE_MAGIC || n_fds < 2, 0,
+               "upgrade: bad state from old server.\n");
+    server->join_fd = fds[0];
+    server->admin_fd = fds[1];
+    DO_ADVANCED = up.advanced;
+    if (DO_ADVANCED) {
+        server->log_fd = fds[2];
+        char sem_name[MAXPATH + 8];
+        snprintf(sem_name, sizeof(sem_name), "%s.sem", server->server_name);
+        server->log_sem = sem_open(sem_name, O_RDWR | O_CREAT, 0644, 1);
+    }
+    server->last_seq = up.last_seq;
+    server->start_time_sec = up.start_time_sec;
+    server->start_ns = up.start_ns;
+    server_clock(server);
+    server->ping_interval = up.ping_interval;
+    server->disconnect_secs = up.disconnect_secs;
+    memcpy(server->id_used, up.id_used, sizeof(up.id_used));
+
+    for (int i = 0; i < up.n_clients; ++i) {
+        upgrade_client_t uc;
+        int cfds[3];
+        len = upgrade_recv(sock, &uc, sizeof(uc), cfds, &n_fds);
+        check_fail(len != sizeof(uc) || n_fds != 2, 0, "upgrade: bad client from old server.\n");
+        client_t *client = &server->client[server->n_clients++];
+        memset(client, 0, sizeof(client_t));
+        strcpy(client->name, uc.name);
+        strcpy(client->to_client_fname, uc.to_client_fname);
+        strcpy(client->to_server_fname, uc.to_server_fname);
+        client->to_client_fd = cfds[0];
+        client->to_server_fd = cfds[1];
+        client->id = uc.id;
+        client->version = uc.version;
+        client->caps = uc.caps;
+        client->enc = uc.enc;
+        client->streaming = uc.streaming;
+        client->stream_left = uc.stream_left;
+        client->stream_rec = uc.stream_rec;
+        client->stream_off = uc.stream_off;
+        client->filter = uc.filter;
+        client->pool_slot = uc.pool_slot;
+        server_pipe_sizes(server, client);
+        if (uc.pool_slot != -1) {
+            pool_slot_t *slot = &server->pool[uc.pool_slot];
+            slot->state = POOL_USED;
+            slot->to_client_fd = client->to_client_fd;
+            slot->to_server_fd = client->to_server_fd;
+        }
+        client->last_contact_ns = uc.last_contact_ns;
+        client->stats = uc.stats;
+        for (int k = 0; k < uc.ctl_count; ++k) {
+            upgrade_recv_frame(sock, &client->ctl_lane);
+        }
+        client->ctl_lane.off = uc.ctl_off;
+        for (int k = 0; k < uc.data_count; ++k) {
+            upgrade_recv_frame(sock, &client->data_lane);
+        }
+        client->data_lane.off = uc.data_off;
+    }
+
+    for (int k = 0; k < up.hist_count; ++k) {
+        mesg_t mesg;
+        len = upgrade_recv(sock, &mesg, sizeof(mesg), fds, &n_fds);
+        check_fail(len != sizeof(mesg), 0, "upgrade: history missing.\n");
+        server_history_add(server, &mesg);
+    }
+    write(sock, "", 1);
+    close(sock);
+    waitpid(up.pid, NULL, 0);
+    for (int k = 0; k < POOL_MAX; ++k) { // free FIFOs of the pool are opened again by name
+        char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+        pool_fifo_names(server->server_name, k, to_client, to_server);
+        pool_slot_t *slot = &server->pool[k];
+        if (slot->state == POOL_NONE && access(to_client, F_OK) == 0) {
+            slot->to_client_fd = open(to_client, O_RDWR | O_NONBLOCK);
+            slot->to_server_fd = open(to_server, O_RDWR);
+            if (slot->to_client_fd != -1 && slot->to_server_fd != -1) {
+                slot->state = POOL_FREE;
+                server->pool_free++;
+            }
+        }
+    }
+    server->pool_target = POOL_MIN;
+    server->pool_window = server->now_ns;
+    server->pipe_max = pipe_max_size();
+    log_printf("upgrade: resumed with %d clients\n", server->n_clients);
+}
+
+// FNV-1a checksum of len bytes at data continuing from sum; start with
+// 2166136261.
+static uint32_t snap_sum(uint32_t sum, const void *data, long len) {
+    const uint8_t *p = data;
+    for (long i = 0; i < len; ++i) {
+        sum = (sum ^ p[i]) * 16777619u;
+    }
+    return sum;
+}
+
+// Checksum of the SNAP_CHECK log bytes before offset, or of what there
+// is if the log is shorter.
+static uint32_t snap_log_sum(int log_fd, long offset) {
+    char buf[SNAP_CHECK];
+    long start = offset > SNAP_CHECK ? offset - SNAP_CHECK : 0;
+    int n_read = pread(log_fd, buf, offset - start, start);
+    return snap_sum(2166136261u, buf, n_read > 0 ? n_read : 0);
+}
+
+// ADVANCED: Write the state a start would rebuild from the log to
+// server_name.snap: the history, sequence number and the names of the
+// clients, the only senders whose names the log after this point may
+// leave out, as of log_offset bytes into the log, which must be its
+// size when the server's state was that being written. Written to a
+// temporary file and renamed over the old one so a crash part way
+// leaves the previous snapshot. Returns 0 on success.
+int server_write_snapshot(server_t *server, long log_offset) {
+    static name_table_t names;
+    memset(&names, 0, sizeof(names));
+    for (int i = 0; i < server->n_clients; ++i) {
+        strcpy(names.names[server->client[i].id], server->client[i].name);
+    }
+    struct stat st;
+    fstat(server->log_fd, &st);
+    snap_hdr_t hdr = {
+        .magic = SNAP_MAGIC,
+        .mesg_size = sizeof(mesg_t),
+        .log_ino = st.st_ino,
+        .log_offset = log_offset,
+        .log_sum = snap_log_sum(server->log_fd, log_offset),
+        .last_seq = server->last_seq,
+        .hist_count = server->hist_count,
+    };
+    hdr.sum = snap_sum(2166136261u, &names, sizeof(names));
+    for (int k = 0; k < server->hist_count; ++k) {
+        hdr.sum = snap_sum(hdr.sum, &server->history[(server->hist_start + k) % HISTORY_LEN], sizeof(mesg_t));
+    }
+
+    char tmp_name[MAXPATH + 16], snap_name[MAXPATH + 16];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.snap.tmp", server->server_name);
+    snprintf(snap_name, sizeof(snap_name), "%s.snap", server->server_name);
+    FILE *out = fopen(tmp_name, "w");
+    if (out == NULL) {
+        return 1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(&names, sizeof(names), 1, out);
+    for (int k = 0; k < server->hist_count; ++k) {
+        fwrite(&server->history[(server->hist_start + k) % HISTORY_LEN], sizeof(mesg_t), 1, out);
+    }
+    int failed = fflush(out) != 0 || fsync(fileno(out)) != 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(tmp_name, snap_name) != 0) {
+        remove(tmp_name);
+        return 1;
+    }
+    return 0;
+}
+
+// ADVANCED: Write a snapshot if SNAPSHOT_SECS have passed since the
+// last, or at once and in this process if now is set as at shutdown.
+// Otherwise the snapshot is written by a forked child from its copy of
+// the server so the main loop does not wait on the disk. None is
+// started while the previous one is being written or while a client is
+// streaming, as the log record of the stream is still being filled in;
+// the next tick tries again. The log's size is taken here, before the
+// fork, as the child's copy of the server matches the log only then;
+// the server goes on logging while the child writes.
+void server_snapshot(server_t *server, int now) {
+    if (server->snap_pid > 0) {
+        if (waitpid(server->snap_pid, NULL, now ? 0 : WNOHANG) == 0) {
+            return;
+        }
+        server->snap_pid = 0;
+    }
+    struct stat st;
+    fstat(server->log_fd, &st);
+    if (now) {
+        server_write_snapshot(server, st.st_size);
+        return;
+    }
+    if (server->time_sec - server->snap_time < SNAPSHOT_SECS) {
+        return;
+    }
+    for (int i = 0; i < server->n_clients; ++i) {
+        if (server->client[i].streaming) {
+            return;
+        }
+    }
+    server->snap_time = server->time_sec;
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL); // an interrupt meant for the server must not shut it down from here
+        signal(SIGTERM, SIG_DFL);
+        _exit(server_write_snapshot(server, st.st_size));
+    }
+    server->snap_pid = pid > 0 ? pid : 0;
+    dbg_printf("server_snapshot: writer %d started\n", pid);
+}
+
+// ADVANCED: Load server_name.snap if it is intact and was written from
+// the log now open, filling the history, sequence number and names.
+// Returns the log offset from which the log must still be read, just
+// past the who_t if there is no usable snapshot.
+long server_load_snapshot(server_t *server, name_table_t *names) {
+    char snap_name[MAXPATH + 16];
+    snprintf(snap_name, sizeof(snap_name), "%s.snap", server->server_name);
+    FILE *in = fopen(snap_name, "r");
+    if (in == NULL) {
+        return sizeof(who_t);
+    }
+    snap_hdr_t hdr;
+    struct stat st;
+    fstat(server->log_fd, &st);
+    int ok = fread(&hdr, sizeof(hdr), 1, in) == 1 && hdr.magic == SNAP_MAGIC &&
+             hdr.mesg_size == sizeof(mesg_t) && hdr.log_ino == st.st_ino &&
+             hdr.log_offset >= sizeof(who_t) && hdr.log_offset <= st.st_size &&
+             hdr.hist_count >= 0 && hdr.hist_count <= HISTORY_LEN &&
+             hdr.log_sum == snap_log_sum(server->log_fd, hdr.log_offset) &&
+             fread(names, sizeof(name_table_t), 1, in) == 1;
+    mesg_t *history = ok ? malloc(sizeof(mesg_t) * (hdr.hist_count + 1)) : NULL;
+    ok = ok && history != NULL && fread(history, sizeof(mesg_t), hdr.hist_count, in) == hdr.hist_count;
+    fclose(in);
+    if (!ok || snap_sum(snap_sum(2166136261u, names, sizeof(name_table_t)), history,
+                        sizeof(mesg_t) * hdr.hist_count) != hdr.sum) {
+        dbg_printf("server_load_snapshot: %s unusable, reading the whole log\n", snap_name);
+        memset(names, 0, sizeof(name_table_t));
+        free(history);
+        return sizeof(who_t);
+    }
+    server->hist_start = 0;
+    server->hist_count = 0;
+    for (int k = 0; k < hdr.hist_count; ++k) {
+        server_history_add(server, &history[k]);
+    }
+    free(history);
+    server->last_seq = hdr.last_seq;
+    dbg_printf("server_load_snapshot: seq %d, log read from %ld\n", hdr.last_seq, (long) hdr.log_offset);
+    return hdr.log_offset;
+}
+
+// Make and open the FIFOs at index k of the pool. Returns 0 on success.
+static int pool_make(server_t *server, int k) {
+    char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+    pool_fifo_names(server->server_name, k, to_client, to_server);
+    remove(to_client);
+    remove(to_server);
+    if (mkfifo(to_client, DEFAULT_PERMS) == -1 || mkfifo(to_server, DEFAULT_PERMS) == -1) {
+        remove(to_client);
+        return -1;
+    }
+    pool_slot_t *slot = &server->pool[k];
+    slot->to_client_fd = open(to_client, O_RDWR | O_NONBLOCK); // as server_add_client() opens them
+    slot->to_server_fd = open(to_server, O_RDWR);
+    check_fail(slot->to_client_fd == -1 || slot->to_server_fd == -1, 1, "open pool fifo %s error.\n", to_client);
+    slot->state = POOL_FREE;
+    server->pool_free++;
+    return 0;
+}
+
+// Close and remove the FIFOs at index k of the pool.
+static void pool_unmake(server_t *server, int k) {
+    char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+    pool_fifo_names(server->server_name, k, to_client, to_server);
+    pool_slot_t *slot = &server->pool[k];
+    close(slot->to_client_fd);
+    close(slot->to_server_fd);
+    remove(to_client);
+    remove(to_server);
+    if (slot->state == POOL_FREE) {
+        server->pool_free--;
+    }
+    slot->state = POOL_NONE;
+}
+
+// Remove any pool left by an earlier server of the same name, whose
+// FIFOs no one serves, and make the first POOL_MIN pairs.
+void server_pool_start(server_t *server) {
+    for (int k = 0; k < POOL_MAX; ++k) {
+        char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+        pool_fifo_names(server->server_name, k, to_client, to_server);
+        remove(to_client);
+        remove(to_server);
+    }
+    server->pool_target = POOL_MIN;
+    server->pool_window = server->now_ns;
+    server_pool_adjust(server);
+}
+
+// Grow or shrink the pool toward pool_target free pairs, which follows
+// twice the joins seen over the last POOL_WINDOW seconds but is never
+// below POOL_MIN. At most POOL_GROW pairs are made per call; more come
+// on later calls. Called after each join and each ping.
+void server_pool_adjust(server_t *server) {
+    long now = server->now_ns;
+    if (now - server->pool_window >= POOL_WINDOW * NANOS_PER_SEC) {
+        int want = 2 * server->pool_joins;
+        server->pool_target = want < POOL_MIN ? POOL_MIN : want > POOL_MAX ? POOL_MAX : want;
+        server->pool_joins = 0;
+        server->pool_window = now;
+    }
+    for (int k = 0, made = 0; k < POOL_MAX && made < POOL_GROW && server->pool_free < server->pool_target; ++k) {
+        if (server->pool[k].state == POOL_NONE && pool_make(server, k) == 0) {
+            made++;
+        }
+    }
+    for (int k = POOL_MAX - 1; k >= 0 && server->pool_free > 2 * server->pool_target; --k) {
+        if (server->pool[k].state == POOL_FREE) { // the highest go first, clients try the lowest first
+            pool_unmake(server, k);
+        }
+    }
+}
+
+// Close and remove every FIFO of the pool.
+void server_pool_close(server_t *server) {
+    for (int k = 0; k < POOL_MAX; ++k) {
+        if (server->pool[k].state != POOL_NONE) {
+            pool_unmake(server, k);
+        }
+    }
+}
+
+// Discard whatever is waiting in the FIFO open on fd.
+static void pool_drain(int fd) {
+    char junk[PIPE_BUF];
+    int n_queued = 0;
+    ioctl(fd, FIONREAD, &n_queued);
+    for (; n_queued > 0; n_queued -= sizeof(junk)) {
+        read(fd, junk, n_queued < sizeof(junk) ? n_queued : sizeof(junk));
+    }
+}
+
+// If the FIFOs named by the joining client are a free pair of the
+// pool, give the client the descriptors already open on them, emptied
+// of anything an earlier client left, and return the index of the
+// pair. Returns -1 for FIFOs the client made itself. A pair in use is
+// refused by setting both descriptors to -1 and returning -1.
+int server_pool_claim(server_t *server, client_t *client) {
+    int k;
+    int prefix = strlen(server->server_name);
+    if (strncmp(client->to_client_fname, server->server_name, prefix) != 0 ||
+        sscanf(client->to_client_fname + prefix, ".pool.%d.", &k) != 1 || k < 0 || k >= POOL_MAX) {
+        return -1;
+    }
+    char to_client[MAXPATH + 32], to_server[MAXPATH + 32];
+    pool_fifo_names(server->server_name, k, to_client, to_server);
+    pool_slot_t *slot = &server->pool[k];
+    if (strcmp(to_client, client->to_client_fname) != 0 || strcmp(to_server, client->to_server_fname) != 0) {
+        return -1;
+    }
+    if (slot->state != POOL_FREE) {
+        dbg_printf("server_pool_claim: %s asked for pool FIFOs %d which are not free\n", client->name, k);
+        client->to_client_fd = client->to_server_fd = -1;
+        return -1;
+    }
+    pool_drain(slot->to_client_fd);
+    pool_drain(slot->to_server_fd);
+    fcntl(slot->to_client_fd, F_SETPIPE_SZ, PIPE_DEFAULT); // sized for the last client, start afresh
+    fcntl(slot->to_server_fd, F_SETPIPE_SZ, PIPE_DEFAULT);
+    client->to_client_fd = slot->to_client_fd;
+    client->to_server_fd = slot->to_server_fd;
+    slot->state = POOL_USED;
+    server->pool_free--;
+    return k;
+}
+
+// Return the departing client's FIFOs to the pool rather than closing
+// and removing them. Anything it sent which was not read is dropped
+// now. Its to-client FIFO is emptied when next claimed; until then the
+// client may still be reading what was sent to it last.
+void server_pool_release(server_t *server, client_t *client) {
+    pool_slot_t *slot = &server->pool[client->pool_slot];
+    pool_drain(slot->to_server_fd);
+    slot->state = POOL_FREE;
+    server->pool_free++;
+}
+
+// Returns the largest FIFO buffer an unprivileged process may ask for.
+int pipe_max_size() {
+    int max = 1 << 20; // the usual limit
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file != NULL) {
+        fscanf(file, "%d", &max);
+        fclose(file);
+    }
+    return max;
+}
+
+// Fill in the client's out_pipe and in_pipe from its FIFOs.
+void server_pipe_sizes(server_t *server, client_t *client) {
+    client->out_pipe = fcntl(client->to_client_fd, F_GETPIPE_SZ);
+    client->in_pipe = fcntl(client->to_server_fd, F_GETPIPE_SZ);
 }
 
+// The FIFO buffer size for a peak of bytes waiting: the power of two
+// holding twice the peak, within PIPE_MIN and max.
+static int pipe_size_for(int peak, int max) {
+    int size = PIPE_MIN;
+    while (size < 2 * peak && size < max) {
+        size *= 2;
+    }
+    return size < max ? size : max;
+}
+
+// Resize the FIFO buffer on fd from *size toward what a peak of bytes
+// waiting calls for: up at once so bursts do not stall the server on a
+// full FIFO, down only below a quarter used so sizes do not flap. The
+// kernel refuses to shrink below what the FIFO holds; that is retried
+// next time.
+static void pipe_resize(int fd, int *size, int peak, int max) {
+    int want = pipe_size_for(peak, max);
+    if (want > *size || 4 * peak < *size) {
+        int got = fcntl(fd, F_SETPIPE_SZ, want);
+        if (got > 0) {
+            *size = got;
+        }
+    }
+}
+
+// Every PIPE_ADJUST_SECS, size each client's FIFO buffers to the most
+// that waited in them since the last time: clients which fall behind
+// in bursts get room up to pipe-max-size, idle ones give kernel memory
+// back down to PIPE_MIN.
+void server_adjust_pipes(server_t *server) {
+    long now = server->now_ns;
+    if (now - server->pipes_adjusted < PIPE_ADJUST_SECS * NANOS_PER_SEC) {
+        return;
+    }
+    server->pipes_adjusted = now;
+    for (int i = 0; i < server->n_clients; ++i) {
+        client_t *client = server_get_client(server, i);
+        int n_unread = 0; // the server holds the FIFO open for reading too, see server_add_client()
+        ioctl(client->to_client_fd, FIONREAD, &n_unread);
+        if (n_unread > client->out_peak) {
+            client->out_peak = n_unread;
+        }
+        int size = client->out_pipe;
+        pipe_resize(client->to_client_fd, &client->out_pipe, client->out_peak, server->pipe_max);
+        if (client->out_pipe != size) {
+            dbg_printf("client %d '%s' to-client FIFO %d -> %d bytes\n", i, client->name, size, client->out_pipe);
+        }
+        pipe_resize(client->to_server_fd, &client->in_pipe, client->in_peak, server->pipe_max);
+        client->out_peak = client->in_peak = 0;
+    }
+}
@@ -1,9 +1,38 @@
 #include "blather.h"
 #include <termios.h>
+#include <sys/uio.h>
 
 static struct termios old_term_settings; // structs to change the terminal input mode
 static struct termios new_term_settings;
 
+// Output from iprintf()/iwrite() is drawn in frames: one write of
+// erase line + all pending output + prompt + typed input. With a frame
+// rate set, output arriving sooner than one frame after the last is
+// held and drawn by render_worker() when the frame is due, so a busy
+// room repaints the prompt at most frame rate times per second. The
+// lock guards the pending output and buf against the other threads.
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t render_thread;
+
+static long now_nanos(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Lock the render state. Cancellation is held off while locked so a
+// thread cancelled mid-write cannot leave the lock taken.
+static void render_lock_take(int *oldstate){
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, oldstate);
+  pthread_mutex_lock(&render_lock);
+}
+
+static void render_lock_drop(int oldstate){
+  pthread_mutex_unlock(&render_lock);
+  pthread_setcancelstate(oldstate, NULL);
+}
+
 // Set non-canonical mode so that each character of input is available
 // immediately
 void simpio_noncanonical_terminal_mode(){
@@ -39,12 +68,15 @@ void simpio_reset_terminal_mode(){
 // Reset the simpio_t object to have 0 for position and flags. Usually
 // done after completing input and processing it.
 void simpio_reset(simpio_t *simpio){
+  int oldstate;
+  render_lock_take(&oldstate);
   simpio->pos = 0;
   simpio->buf[0] = '\0';
   simpio->line_ready = 0;
   simpio->end_of_input = 0;
   simpio->infile  = stdin;
   simpio->outfile = stdout;
+  render_lock_drop(oldstate);
 }
 
 // Set the prompt for the simpio handle. Maximum length for the prompt
@@ -54,64 +86,175 @@ void simpio_set_prompt(simpio_t *simpio, char *prompt){
 }
 
 // Assumes things are in non-canonical terminal mode otherwise results
-// may vary.  Read a character from the input associated with
+// may vary.  Read characters from the input associated with
 // simpio. Fields are adjusted to reflect the state of input after
-// reading the character. Typically:
+// processing them. Typically:
 // 
 // - simpio->pos will increase
-// - simpio->buf will get one more character
+// - simpio->buf will get more characters
 // - simpio->line_ready may be set to 1 if a line is completed 
 // - for backspaces, buf and pos decrease
 // 
+// Whatever input is available is taken with a single read() into
+// simpio->inbuf, so a paste or piped input costs one read and one echo
+// write per batch rather than per character. Processing stops at the
+// end of a line or of input; characters after that stay in inbuf for
+// the next call.
+//
 // This function is used in a loop to read input until line_ready is 1.
 void simpio_get_char(simpio_t *simpio){
-  int c = fgetc(simpio->infile);
-  if(0){}
-  else if(c == '\n' && simpio->pos > 0){
-    simpio->buf[simpio->pos] = '\0';
-    simpio->line_ready = 1;
-  }    
-  else if((c == '\b' || c == DEL || c == '\n') && simpio->pos == 0){
-    // ignore enter, backspace without input
+  if(simpio->in_pos == simpio->in_len){                   // nothing buffered, read more
+    int n = read(fileno(simpio->infile), simpio->inbuf, sizeof(simpio->inbuf));
+    if(n == -1 && errno == EINTR){
+      return;
+    }
+    simpio->in_pos = 0;
+    simpio->in_len = n > 0 ? n : 0;
+    if(n <= 0){                                           // end of input or error
+      simpio->end_of_input = 1;
+      return;
+    }
+  }
+
+  char echo[3*sizeof(simpio->inbuf)];                     // echo for the whole batch
+  int echo_len = 0;
+  int oldstate;
+  render_lock_take(&oldstate);                            // buf is also drawn by frames
+  while(simpio->in_pos < simpio->in_len && !simpio->line_ready && !simpio->end_of_input){
+    int c = (unsigned char) simpio->inbuf[simpio->in_pos++];
+    if(0){}
+    else if(c == '\n' && simpio->pos > 0){
+      simpio->buf[simpio->pos] = '\0';
+      simpio->line_ready = 1;
+    }    
+    else if((c == '\b' || c == DEL || c == '\n') && simpio->pos == 0){
+      // ignore enter, backspace without input
+    }
+    else if(c == EOT && simpio->pos > 0){
+      simpio->buf[simpio->pos] = '\0';
+      simpio->line_ready = 1;
+    }    
+    else if((c == '\b' || c == DEL) && simpio->pos > 0){ // backspace or delete
+      simpio->pos = simpio->pos-1;
+      simpio->buf[simpio->pos] = '\0';
+      memcpy(echo+echo_len, "\b \b", 3);                  // erase last character
+      echo_len += 3;
+    }
+    else if(c != EOT && simpio->pos < MAXLINE-1){         // normal chars get added
+      simpio->buf[simpio->pos] = c;
+      simpio->pos++;
+      simpio->buf[simpio->pos] = '\0';
+      echo[echo_len++] = c;
+    }
+    if(c == EOT){                                         // check for end of input
+      simpio->end_of_input = 1;
+    }
+  }
+  if(echo_len > 0){
+    write(fileno(simpio->outfile), echo, echo_len);
+  }
+  render_lock_drop(oldstate);
+}
+
+// Draw a frame with all pending output followed by the extra text;
+// render_lock must be held.
+static void render_frame(simpio_t *simpio, char *extra, int extra_len){
+  struct iovec iov[5] = {
+    { .iov_base = "\33[2K\r",        .iov_len = 5 },                      // erase line
+    { .iov_base = simpio->pending,   .iov_len = simpio->pending_len },    // held output
+    { .iov_base = extra,             .iov_len = extra_len },              // the new output
+    { .iov_base = simpio->prompt,    .iov_len = strlen(simpio->prompt) }, // add prompt back
+    { .iov_base = simpio->buf,       .iov_len = strlen(simpio->buf) },    // current typed input
+  };
+  int fd = fileno(simpio->outfile);
+  writev(fd, iov, 5);
+  simpio->pending_len = 0;
+  simpio->dirty = 0;
+  simpio->last_frame = now_nanos();
+}
+
+// Add output to be shown ahead of the prompt: drawn immediately if a
+// frame is due, otherwise held for render_worker().
+static void render_output(simpio_t *simpio, char *text, int len){
+  int oldstate;
+  render_lock_take(&oldstate);
+  if(simpio->frame_nanos == 0 ||
+     now_nanos() - simpio->last_frame >= simpio->frame_nanos ||
+     simpio->pending_len + len > RENDER_BUFSIZE){
+    render_frame(simpio, text, len);
   }
-  else if(c == EOT && simpio->pos > 0){
-    simpio->buf[simpio->pos] = '\0';
-    simpio->line_ready = 1;
-  }    
-  else if((c == '\b' || c == DEL) && simpio->pos > 0){ // backspace or delete
-    simpio->pos = simpio->pos-1;
-    simpio->buf[simpio->pos] = '\0';
-    int fd = fileno(simpio->outfile);
-    write(fd, "\b \b", 3);                              // erase last character
+  else{
+    memcpy(simpio->pending + simpio->pending_len, text, len);
+    simpio->pending_len += len;
+    if(!simpio->dirty){
+      simpio->dirty = 1;
+      pthread_cond_signal(&render_cond);
+    }
   }
-  else if(c != EOF && c != EOT && simpio->pos < MAXLINE-1){ // normal chars get added
-    simpio->buf[simpio->pos] = c;
-    simpio->pos++;
-    simpio->buf[simpio->pos] = '\0';
-    fputc(c,simpio->outfile);
+  render_lock_drop(oldstate);
+}
+
+// Thread which draws held output once its frame is due.
+static void *render_worker(void *arg){
+  simpio_t *simpio = arg;
+  pthread_mutex_lock(&render_lock);
+  while(1){
+    while(!simpio->dirty){
+      pthread_cond_wait(&render_cond, &render_lock);
+    }
+    long wait = simpio->last_frame + simpio->frame_nanos - now_nanos();
+    if(wait > 0){                                               // sleep until the frame is due
+      pthread_mutex_unlock(&render_lock);
+      struct timespec tm = { .tv_sec = wait / 1000000000L, .tv_nsec = wait % 1000000000L };
+      nanosleep(&tm, NULL);
+      pthread_mutex_lock(&render_lock);
+      continue;
+    }
+    render_frame(simpio, NULL, 0);
   }
-  if(c == EOF || c == EOT){     // check for end of input
-    simpio->end_of_input = 1;
+  return NULL;
+}
+
+// Limit terminal repaints from iprintf()/iwrite() to fps frames per
+// second; fps of 0 or less draws every output as soon as it is
+// printed. Call once after simpio_reset() and before other threads
+// print.
+void simpio_set_frame_rate(simpio_t *simpio, int fps){
+  simpio->frame_nanos = fps > 0 ? 1000000000L / fps : 0;
+  if(simpio->frame_nanos > 0){
+    pthread_create(&render_thread, NULL, render_worker, simpio);
+    pthread_detach(render_thread);
   }
 }
 
+// Draw any held output now. Call before exiting so nothing printed is
+// lost.
+void simpio_flush(simpio_t *simpio){
+  int oldstate;
+  render_lock_take(&oldstate);
+  if(simpio->dirty){
+    render_frame(simpio, NULL, 0);
+  }
+  render_lock_drop(oldstate);
+}
+
 // Print like printf but move the input prompt ahead and preserve the
 // input that has been typed so far along with the prompt.
 void iprintf(simpio_t *simpio, char *fmt, ...){
   char output[MAXLINE*2];       // buffer for message
-  int max = MAXLINE*2;
-  int off = 0;
-  off += snprintf(output+off, max-off, "\33[2K\r");           // erase line
   va_list myargs;
   va_start(myargs, fmt);
-  off += vsnprintf(output+off,MAXLINE,fmt,myargs);            // add on the new message
+  int off = vsnprintf(output,sizeof(output),fmt,myargs);      // format the new message
   va_end(myargs);
-  off += snprintf(output+off, max-off, "%s", simpio->prompt); // add prompt back
-  off += snprintf(output+off, max-off, "%s", simpio->buf);    // current typed input
-  
-  int fd = fileno(simpio->outfile);
-  write(fd, output, off);
+  if(off > (int) sizeof(output)-1){
+    off = sizeof(output)-1;
+  }
+  render_output(simpio, output, off);
+}
 
-  // fprintf(input->outfile, "%s", input->prompt);
-  // simpio_print(input);
+// Print a block of already formatted output, usually several complete
+// lines, ahead of the prompt and the input typed so far. Same effect
+// as iprintf() for any amount of text.
+void iwrite(simpio_t *simpio, char *text, int len){
+  render_output(simpio, text, len);
 }
@@ -0,0 +1,63 @@
+// Latency tracing. Clients granted CAP_TRACE stamp their chat with the
+// time it was sent; the server adds when it read it and when it queued
+// it for recipients and sends the stamps on to traced recipients, which
+// note when it was displayed. Each side keeps a histogram per hop of
+// the way. All stamps are CLOCK_MONOTONIC, which every process on the
+// machine shares, so stamps from different processes can be compared.
+
+#include "blather.h"
+
+// names of the hops for printing, by TRACE_ hop
+static char *hop_names[N_TRACE_HOPS] = {
+    "client to server", "server", "server write", "server to display", "end to end",
+};
+
+// Returns CLOCK_MONOTONIC in nanoseconds, for waits which must see
+// time pass and for trace stamps; the server's other timings use the
+// server clock.
+long clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NANOS_PER_SEC + ts.tv_nsec;
+}
+
+// Count one latency of ns nanoseconds in hist. Bucket b holds
+// latencies below 2^b microseconds; the last takes everything longer.
+void hist_add(lat_hist_t *hist, long ns) {
+    if (ns < 0) { // stamps from before a clock step, should not happen
+        ns = 0;
+    }
+    hist->count++;
+    hist->sum_ns += ns;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    int b = 0;
+    for (long us = ns / 1000; us > 0 && b < HIST_BUCKETS - 1; us >>= 1) {
+        b++;
+    }
+    hist->buckets[b]++;
+}
+
+// Returns the upper bound in microseconds of the bucket holding the
+// pct percentile of hist's latencies.
+static long hist_percentile(lat_hist_t *hist, int pct) {
+    long want = (hist->count * pct + 99) / 100, seen = 0;
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && (seen += hist->buckets[b]) < want) {
+        b++;
+    }
+    return 1L << b;
+}
+
+// Format a line summarizing the hist of the given TRACE_ hop into out
+// which has room for max characters. Returns the number of characters
+// added, none for a hop nothing was traced through.
+int hist_format(lat_hist_t *hist, int hop, char *out, int max) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    return snprintf(out, max, "trace %-17s n %ld mean %.1fus p50 <%ldus p99 <%ldus max %.1fus\n",
+                    hop_names[hop], hist->count, (double) hist->sum_ns / hist->count / 1000,
+                    hist_percentile(hist, 50), hist_percentile(hist, 99), (double) hist->max_ns / 1000);
+}